@@ -0,0 +1,151 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(*
+  Periodic autosave snapshots.
+
+  On Unix the snapshot is written by a forked child process: fork gives it a
+  copy-on-write image of the whole state (including the mutable arrays of
+  geo.G.rm, Org.Astr.regsa and the regions), so the game loop does not wait
+  for the serialization. Elsewhere the snapshot is saved synchronously.
+
+  Snapshots are Savegame directories dir/snap.N. A snapshot is written as
+  dir/snap.N.tmp and renamed when complete, old ones are removed so that
+  only the newest [keep] remain.
+
+  Configuration (environment):
+    WANDERERS_AUTOSAVE_INTERVAL  seconds between snapshots (0 disables autosave)
+    WANDERERS_AUTOSAVE_KEEP      number of kept snapshots
+*)
+
+type config = {interval: float; keep: int; dir: string}
+
+let default_config = {interval = 300.0; keep = 3; dir = "autosave"}
+
+let config_from_env () =
+  let get name conv default =
+    try conv (Sys.getenv name) with Not_found | Failure _ -> default in
+  { default_config with
+    interval = get "WANDERERS_AUTOSAVE_INTERVAL" float_of_string default_config.interval;
+    keep = max 1 (get "WANDERERS_AUTOSAVE_KEEP" int_of_string default_config.keep);
+  }
+
+type t =
+  { config: config;
+    mutable last: float;          (* time of the last snapshot *)
+    mutable child: int option;    (* pid of the process writing a snapshot *)
+    mutable counter: int;         (* number of the next snapshot *)
+  }
+
+let snap_prefix = "snap."
+
+(* numbers of the complete snapshots in the directory, newest first *)
+let snapshots config =
+  let files = try Sys.readdir config.dir with Sys_error _ -> [||] in
+  let plen = String.length snap_prefix in
+  Array.fold_left (fun acc f ->
+    let len = String.length f in
+    if len > plen && String.sub f 0 plen = snap_prefix then
+      try int_of_string (String.sub f plen (len - plen)) :: acc with Failure _ -> acc
+    else
+      acc
+  ) [] files
+  |> List.sort (fun a b -> compare b a)
+
+let snapshot_dir config n = Filename.concat config.dir (snap_prefix ^ string_of_int n)
+
+let make config =
+  { config;
+    last = Unix.gettimeofday ();
+    child = None;
+    counter = (match snapshots config with n :: _ -> n + 1 | [] -> 0) }
+
+let rec remove_tree path =
+  if Sys.file_exists path then
+  ( if Sys.is_directory path then
+    ( Array.iter (fun f -> remove_tree (Filename.concat path f)) (Sys.readdir path);
+      Unix.rmdir path )
+    else
+      Sys.remove path )
+
+let write_snapshot config n s =
+  if not (Sys.file_exists config.dir) then Unix.mkdir config.dir 0o755;
+  let final = snapshot_dir config n in
+  let tmp = final ^ ".tmp" in
+  remove_tree tmp;
+  Savegame.save s tmp;
+  Sys.rename tmp final;
+  (* remove the old ones *)
+  List.iteri (fun i n -> if i >= config.keep then remove_tree (snapshot_dir config n)) (snapshots config)
+
+(* collect the finished writer *)
+let reap a =
+  match a.child with
+  | Some pid ->
+      ( match Unix.waitpid [Unix.WNOHANG] pid with
+        | (0, _) -> ()
+        | _ -> a.child <- None
+        | exception Unix.Unix_error _ -> a.child <- None )
+  | None -> ()
+
+let save_now a s =
+  let n = a.counter in
+  a.counter <- n + 1;
+  a.last <- Unix.gettimeofday ();
+  if Sys.os_type = "Unix" then
+  ( flush stdout;
+    flush stderr;
+    match Unix.fork () with
+    | 0 ->
+        (try write_snapshot a.config n s with _ -> ());
+        (* leave without running the at_exit handlers of the parent (SDL, OpenGL) *)
+        Unix.kill (Unix.getpid ()) Sys.sigkill
+    | pid -> a.child <- Some pid )
+  else
+    (try write_snapshot a.config n s with Sys_error _ | Unix.Unix_error _ -> ())
+
+(* called every frame, takes a snapshot when the interval has passed *)
+let update a s =
+  reap a;
+  if a.config.interval > 0.0 && a.child = None &&
+     Unix.gettimeofday () -. a.last >= a.config.interval then
+    save_now a s
+
+(* wait for the snapshot being written, e.g. before exiting *)
+let finish a =
+  match a.child with
+  | Some pid ->
+      (try ignore (Unix.waitpid [] pid) with Unix.Unix_error _ -> ());
+      a.child <- None
+  | None -> ()
+
+(* the newest valid save among the given save directory and the snapshots *)
+let recover config save_dir =
+  let mtime dir =
+    try (Unix.stat (Filename.concat dir "header")).Unix.st_mtime with Unix.Unix_error _ -> neg_infinity in
+  let candidates =
+    save_dir :: List.map (snapshot_dir config) (snapshots config)
+    |> List.map (fun dir -> (mtime dir, dir))
+    |> List.filter (fun (t, _) -> t > neg_infinity)
+    |> List.sort (fun (t1, _) (t2, _) -> compare t2 t1) in
+  let rec first = function
+    | (_, dir) :: tl ->
+        ( match Savegame.load dir with
+          | Some s -> Printf.printf "Loaded %s\n%!" dir; Some s
+          | None -> first tl )
+    | [] -> None
+  in
+  first candidates
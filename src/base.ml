@@ -126,6 +126,27 @@ let array_permute a =
     a.(j2) <- t
   done
 
+(* Random streams.
+   A stream is derived from integer keys (world seed, step number, region id, ...),
+   so the numbers a part of the simulation gets do not depend on the order in which
+   the parts are run. The code inside keeps calling Random, [use] installs the stream
+   as the global generator for the duration of a call and then puts the old one back *)
+module Rng = struct
+  type t = Random.State.t
+
+  let derive keys = Random.State.make keys
+  
+  (* the same stream as after Random.init seed *)
+  let of_seed seed = Random.State.make [|seed|]
+
+  let use st f =
+    let saved = Random.get_state () in
+    Random.set_state st;
+    match f () with
+    | x -> Random.set_state saved; x
+    | exception e -> Random.set_state saved; raise e
+end
+
 (* Bin Weighted Counter - for log-time random selection/update *)
 module Bwc = struct
   type t = {sum: float array; cur: float array; total: float}
@@ -0,0 +1,68 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(* World generation benchmark: the phases of State.make are timed separately
+   for a fixed set of seeds. Output is tab-separated, one line per phase:
+     seed  phase  wall time (s)  allocated words *)
+
+open Common
+open Global
+open Printf
+
+let default_seeds = ["a"; "wanderers"; "xyz"; "qwerty"; "bench"]
+
+let allocated_words () =
+  let st = Gc.quick_stat () in
+  st.Gc.minor_words +. st.Gc.major_words -. st.Gc.promoted_words
+
+(* run f, print its time and allocation, return its result *)
+let phase seed name f =
+  let w0 = allocated_words () in
+  let t0 = Unix.gettimeofday () in
+  let x = f () in
+  let t1 = Unix.gettimeofday () in
+  let w1 = allocated_words () in
+  printf "%s\t%s\t%.6f\t%.0f\n%!" seed name (t1 -. t0) (w1 -. w0);
+  x
+
+(* same sequence of steps (and random numbers) as in State.make *)
+let run_seed seed =
+  Random.init (State.seed_of_string seed);
+  let facnum = default_factions_number in
+  let pol = Politics.make_variety facnum in
+  let total0 = Unix.gettimeofday () in
+  let altitude, forestation, b_cc_m, m_bonuses =
+    phase seed "cube" (fun () -> Genmap.Cube.prepare 45 45 20) in
+  let b_cc_m = phase seed "connect_everything" (fun () -> Genmap.Cube.connect_everything b_cc_m) in
+  let b_cc_m = phase seed "dig" (fun () -> Genmap.Cube.dig b_cc_m) in
+  let geo = phase seed "geo_of_cube"
+    (fun () -> Genmap.Cube.geo_of_cube facnum altitude forestation b_cc_m m_bonuses) in
+  let astr = Org.Astr.make_empty (Array.length geo.G.rm) in
+  let world_seed = State.seed_of_string seed in
+  let geo, _ = phase seed "warm_up" (fun () -> State.warm_up world_seed pol (geo, astr)) in
+  let _ = phase seed "atlas" (fun () -> Atlas.make pol geo) in
+  printf "%s\ttotal\t%.6f\t-\n%!" seed (Unix.gettimeofday () -. total0)
+
+let main () =
+  let seeds =
+    match Array.to_list Sys.argv with
+    | _ :: (_::_ as ls) -> ls
+    | _ -> default_seeds
+  in
+  printf "seed\tphase\twall_s\talloc_words\n%!";
+  List.iter run_seed seeds
+
+let _ = main ()
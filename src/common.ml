@@ -25,6 +25,8 @@ module Area = struct
     let data = Array.init w (fun i -> Array.init h (fun j -> f i j)) in
     {data}
     
+  let copy a = {data = Array.map Array.copy a.data}
+
   let get a (i,j) = a.data.(i).(j) 
   let set a (i,j) v = a.data.(i).(j) <- v 
   
@@ -80,8 +82,111 @@ module Tile = struct
   | CWall | CDoor IsClosed -> false
 end
 
+(* Grid of tiles. A tile is stored as its byte code in a flat Bytes (index i*h + j),
+   the code tables give its value and properties without matching on the variant.
+   Walkability and line of sight are also kept as bit masks, a row j is nw words 
+   with the bit i land (bits-1) of the word i lsr bits_log for the column i.
+   version changes whenever a tile does (doors, bonus towers), caches depend on it *)
+module Tiles = struct
+  type t = {w: int; h: int; codes: Bytes.t; 
+    nw: int; walk_m: int array; look_m: int array; 
+    mutable version: int}
+
+  (* all tiles, the index is the code *)
+  let all = Tile.(
+    [| Grass; Wall; Tree1; Tree2; Rock1; Rock2; 
+       BigRock 0; BigRock 1; BigRock 2; BigRock 3;
+       SwampyGround; SwampyPool; RockyGround; SnowyGround; IcyGround; WoodenFloor;
+       Door IsOpen; Door IsClosed;
+       MarketStand 0; MarketStand 1; MarketStand 2; MarketStand 3; MarketStand 4; MarketStand 5;
+       BonusTower false; BonusTower true;
+       DungeonFloor; DungeonWall; DungeonDoor IsOpen; DungeonDoor IsClosed;
+       CaveFloor; CaveWall; CaveDoor IsOpen; CaveDoor IsClosed |] )
+
+  let code = Tile.(function
+    | Grass -> 0 | Wall -> 1 | Tree1 -> 2 | Tree2 -> 3 | Rock1 -> 4 | Rock2 -> 5
+    | BigRock x when x >= 0 && x < 4 -> 6 + x
+    | SwampyGround -> 10 | SwampyPool -> 11 | RockyGround -> 12 | SnowyGround -> 13 
+    | IcyGround -> 14 | WoodenFloor -> 15
+    | Door IsOpen -> 16 | Door IsClosed -> 17
+    | MarketStand x when x >= 0 && x < 6 -> 18 + x
+    | BonusTower false -> 24 | BonusTower true -> 25
+    | DungeonFloor -> 26 | DungeonWall -> 27 | DungeonDoor IsOpen -> 28 | DungeonDoor IsClosed -> 29
+    | CaveFloor -> 30 | CaveWall -> 31 | CaveDoor IsOpen -> 32 | CaveDoor IsClosed -> 33
+    | BigRock _ | MarketStand _ -> invalid_arg "Tiles.code" )
+
+  let _ = Array.iteri (fun i tile -> assert (code tile = i)) all
+
+  (* properties by code *)
+  let cls = Array.map Tile.classify all
+  let walk = Array.map (fun tile -> Tile.can_walk (Tile.classify tile)) all
+  let look = Array.map (fun tile -> Tile.can_look (Tile.classify tile)) all
+  let traction = Array.map Tile.get_traction all
+  let friction = Array.map Tile.get_friction all
+
+  let bits_log = if Sys.word_size = 64 then 5 else 4
+  let bits = 1 lsl bits_log
+
+  let set_bit m t i j b =
+    let k = j*t.nw + (i lsr bits_log) in
+    let bit = 1 lsl (i land (bits-1)) in
+    m.(k) <- if b then m.(k) lor bit else m.(k) land (lnot bit)
+  
+  let get_bit m t i j = (m.(j*t.nw + (i lsr bits_log)) lsr (i land (bits-1))) land 1 = 1
+
+  let set_code t i j c =
+    Bytes.unsafe_set t.codes (i*t.h + j) (Char.unsafe_chr c);
+    set_bit t.walk_m t i j walk.(c);
+    set_bit t.look_m t i j look.(c)
+
+  let create w h =
+    let nw = (w + bits - 1) lsr bits_log in
+    {w; h; codes = Bytes.create (w*h); nw; walk_m = Array.make (nw*h) 0; look_m = Array.make (nw*h) 0; version = 0}
+
+  (* f is called in the same order as in Area.init *)
+  let init w h f = 
+    let t = create w h in
+    for i = 0 to w-1 do
+      for j = 0 to h-1 do
+        set_code t i j (code (f i j))
+      done
+    done;
+    t
+
+  let make w h tile = init w h (fun _ _ -> tile)
+
+  let copy t = {t with codes = Bytes.copy t.codes; walk_m = Array.copy t.walk_m; look_m = Array.copy t.look_m}
+
+  let w t = t.w
+  let h t = t.h
+  let is_within t (i,j) = i >= 0 && i < t.w && j >= 0 && j < t.h
+  let put_inside t (i,j) = ((i + t.w) mod t.w, (j + t.h) mod t.h)
+
+  let check t loc = if not (is_within t loc) then invalid_arg "index out of bounds"
+
+  let code_at t ((i,j) as loc) = 
+    check t loc;
+    Char.code (Bytes.unsafe_get t.codes (i*t.h + j))
+
+  let get t loc = all.(code_at t loc)
+  let set t ((i,j) as loc) tile = 
+    let c = code tile in
+    if code_at t loc <> c then
+    ( set_code t i j c;
+      t.version <- t.version + 1 )
+
+  let classify t loc = cls.(code_at t loc)
+  let can_walk t ((i,j) as loc) = check t loc; get_bit t.walk_m t i j
+  let can_look t ((i,j) as loc) = check t loc; get_bit t.look_m t i j
+  let get_traction t loc = traction.(code_at t loc)
+  let get_friction t loc = friction.(code_at t loc)
+
+  (* the k-th word of the walk mask of the row j, the bit b is the cell (k*bits + b, j) *)
+  let walk_word t j k = t.walk_m.(j*t.nw + k)
+end
+
 let is_walkable area loc =
-  Area.is_within area loc && Tile.can_walk (Tile.classify (Area.get area loc))
+  Tiles.is_within area loc && Tiles.can_walk area loc
 
 type edge_type = East | North | West | South | Up | Down | Other
 
@@ -105,6 +210,76 @@ module Proj = struct
 
 end
 
+(* Projectiles of a region, a pool of parallel arrays. The projectiles 0..n-1 
+   are in use, a removed one is replaced by the last one. The arrays are 
+   allocated with the first projectile and doubled when the pool is full *)
+module Projs = struct
+
+  type t = {
+    mutable n: int;
+    mutable px: float array;
+    mutable py: float array;
+    mutable vx: float array;
+    mutable vy: float array;
+    mutable mass: float array;
+    mutable dmgmult: float array;
+    mutable drag: float array;
+    mutable tp: Proj.tp array;
+  }
+
+  let make () = 
+    {n = 0; px = [||]; py = [||]; vx = [||]; vy = [||]; mass = [||]; dmgmult = [||]; drag = [||]; tp = [||]}
+
+  let grow d =
+    let n = Array.length d.px in
+    let n' = max 64 (2*n) in
+    let extend a x = let a' = Array.make n' x in Array.blit a 0 a' 0 n; a' in
+    d.px <- extend d.px 0.0;
+    d.py <- extend d.py 0.0;
+    d.vx <- extend d.vx 0.0;
+    d.vy <- extend d.vy 0.0;
+    d.mass <- extend d.mass 0.0;
+    d.dmgmult <- extend d.dmgmult 0.0;
+    d.drag <- extend d.drag 0.0;
+    d.tp <- extend d.tp Proj.Arrow
+
+  let length d = d.n
+
+  let add pj d =
+    if d.n >= Array.length d.px then grow d;
+    let k = d.n in
+    let (px, py) = pj.Proj.pos and (vx, vy) = pj.Proj.vel in
+    d.px.(k) <- px;
+    d.py.(k) <- py;
+    d.vx.(k) <- vx;
+    d.vy.(k) <- vy;
+    d.mass.(k) <- pj.Proj.item.Proj.mass;
+    d.dmgmult.(k) <- pj.Proj.item.Proj.dmgmult;
+    d.drag.(k) <- pj.Proj.item.Proj.drag;
+    d.tp.(k) <- pj.Proj.item.Proj.tp;
+    d.n <- k + 1
+
+  let get d k =
+    { Proj.pos = (d.px.(k), d.py.(k)); 
+      Proj.vel = (d.vx.(k), d.vy.(k));
+      Proj.item = {Proj.mass = d.mass.(k); Proj.dmgmult = d.dmgmult.(k); Proj.drag = d.drag.(k); Proj.tp = d.tp.(k)} }
+
+  let remove d k =
+    let last = d.n - 1 in
+    d.px.(k) <- d.px.(last);
+    d.py.(k) <- d.py.(last);
+    d.vx.(k) <- d.vx.(last);
+    d.vy.(k) <- d.vy.(last);
+    d.mass.(k) <- d.mass.(last);
+    d.dmgmult.(k) <- d.dmgmult.(last);
+    d.drag.(k) <- d.drag.(last);
+    d.tp.(k) <- d.tp.(last);
+    d.n <- last
+
+  let iter f d = 
+    for k = 0 to d.n - 1 do f (get d k) done
+end
+
 type faction = int
 
 type path = loc list
@@ -449,7 +624,7 @@ module Unit = struct
         let dmg_defended = if Random.float 1.0 < t_defense then 0.0 else dmg in
         {uc with hp = uc.hp -. dmg_defended} )
   
-    let heal dhp uc = {uc with hp = min (uc.hp +. dhp) uc.prop.mass}
+    let heal dhp uc = if uc.hp = uc.prop.mass then uc else {uc with hp = min (uc.hp +. dhp) uc.prop.mass}
     let add_energy d uc = {uc with eng = (uc.eng +. d) |> min uc.prop.max_eng |> max 0.0 }
 
     let upd_inv inv uc = adjust_aux_info {uc with inv}
@@ -569,7 +744,6 @@ module Unit = struct
     core:Core.t; 
     loc:loc; pos:vec; vel:vec; ac: action list;
     transfer: edge_type option; 
-    sight: int Area.t;
     fnctqn: Fencing.tq_name;
     ntfy: notification list;
     tactmem: TactMem.t;
@@ -618,15 +792,16 @@ module Unit = struct
   
   let upd_core core u = {u with core = core}
 
+  (* id of the next unit, saved with the game state (State.with_unit_ids) *)
+  let next_id = ref 0
+
   let create_maker () =
-    let id0 = ref 0 in
     ( fun fac sp controller loc ->
-        let id = !id0 in
-        id0 := !id0 + 1;
+        let id = !next_id in
+        incr next_id;
         let core = Core.make fac sp controller in
         { id; loc; pos=vec_of_loc loc; vel=(0.0,0.0); ac=[];
           core; transfer = None;
-          sight = Area.make 1 1 0;
           fnctqn = Fencing.default_tqn;
           ntfy = [];
           tactmem = TactMem.empty;
@@ -673,7 +848,9 @@ module Unit = struct
       ac = [Timed (None, 0.0, dt, Stunned)];
       ntfy = nntfy}
 
-  let heal dhp u = {u with core = Core.heal dhp u.core}
+  let heal dhp u = 
+    let core = Core.heal dhp u.core in 
+    if core == u.core then u else {u with core}
   let add_energy d u = {u with core = Core.add_energy d u.core}
 
   (* unit to resources *)
@@ -681,27 +858,27 @@ module Unit = struct
 
   let make_long_path a u =
     let rec path l dl n = 
-      if n > 0 && (not (Area.is_within a l) || is_walkable a l) then 
+      if n > 0 && (not (Tiles.is_within a l) || is_walkable a l) then 
         l :: path (l++dl) dl (n-1) 
       else [] in
     match Random.int 2 with
     | 0 -> 
         let x0,_ = u.loc in
-        let x1 = Random.int (Area.w a + 2) - 1 in
+        let x1 = Random.int (Tiles.w a + 2) - 1 in
         let dx = x1-x0 in
         if dx > 0 then path (u.loc ++ (1,0)) (1,0) (abs dx)
         else if dx < 0 then path (u.loc ++ (-1,0)) (-1,0) (abs dx)
         else []
     | _ -> 
         let _,y0 = u.loc in
-        let y1 = Random.int (Area.h a + 2) - 1 in
+        let y1 = Random.int (Tiles.h a + 2) - 1 in
         let dy = y1-y0 in
         if dy > 0 then path (u.loc ++ (0,1)) (0,1) dy
         else if dy < 0 then path (u.loc ++ (0,-1)) (0,-1) (-dy)
         else []
   
   let make_path_to a u tloc =
-    let ok l = (not (Area.is_within a l)) || is_walkable a l in
+    let ok l = (not (Tiles.is_within a l)) || is_walkable a l in
     (* (si,sj) are the signs, and (adi,adj) are the magnitudes of the displacement *)
     let rec next steps (i,j) ((si,sj), (mi,mj)) =
       if steps > 0 then
@@ -727,8 +904,8 @@ module Unit = struct
     let (x0,y0) = u.loc in
     let dstloc = 
       match Random.int 2 with
-      | 0 -> (Random.int (Area.w a + 2) - 1, y0)
-      | _ -> (x0, Random.int (Area.h a + 2) - 1)
+      | 0 -> (Random.int (Tiles.w a + 2) - 1, y0)
+      | _ -> (x0, Random.int (Tiles.h a + 2) - 1)
     in
     make_path_to a u dstloc 
 
@@ -745,67 +922,282 @@ end
 
 
 (* units registry, by id and by loc *)
+(* Units of a region, indexed by id and by location.
+   A dense grid of the region's size keeps a doubly linked list of slots per cell,
+   units outside the region (about to be transferred) share one extra cell.
+   The registry is mutable: upd and rm change it in place and return it.
+   Kinematic fields of the units are also kept per slot in unboxed arrays 
+   for the physics kernels. *)
 module E = struct
   type id = int
-  module Mi = Map.Make (struct type t = id let compare = compare end)
-  module Ml = Map.Make (struct type t = loc let compare = compare end)
-  type t = {id: Unit.t Mi.t; at: (id list) Ml.t}
+  type t = 
+    { w: int;
+      h: int;
+      head: int array;              (* cell -> its first slot, -1 if the cell is empty *)
+      mutable units: Unit.t array;  (* slot -> unit *)
+      mutable cell: int array;      (* slot -> its cell, -1 if the slot is free *)
+      mutable next: int array;      (* next slot in the same cell, or in the free list *)
+      mutable prev: int array;      (* previous slot in the same cell *)
+      mutable free: int;            (* first free slot, -1 if there are none *)
+      slot: (id, int) Hashtbl.t;    (* id -> slot *)
+      (* per slot copies of the unit's fields *)
+      mutable ids: int array;
+      mutable li: int array;        (* loc *)
+      mutable lj: int array;
+      mutable px: float array;      (* pos *)
+      mutable py: float array;
+      mutable vx: float array;      (* vel *)
+      mutable vy: float array;
+      mutable mass: float array;    (* total mass *)
+      mutable radius: float array;
+      (* collision force on the slot's unit, see Sim.collide *)
+      mutable fx: float array;
+      mutable fy: float array;
+      (* pos before the last step, for drawing between the steps *)
+      mutable prevx: float array;
+      mutable prevy: float array;
+      (* sleeping units are not simulated, see Sim.run_region *)
+      mutable sleep: float array;   (* time left to sleep, 0 if awake *)
+      mutable slept: float array;   (* time slept through, not caught up yet *)
+      mutable sfx: float array;     (* collision force when fell asleep *)
+      mutable sfy: float array;
+    }
+
+  let make w h = 
+    { w; h; head = Array.make (w*h + 1) (-1); 
+      units = [||]; cell = [||]; next = [||]; prev = [||]; free = -1;
+      slot = Hashtbl.create 32;
+      ids = [||]; li = [||]; lj = [||]; px = [||]; py = [||]; vx = [||]; vy = [||];
+      mass = [||]; radius = [||]; fx = [||]; fy = [||]; prevx = [||]; prevy = [||];
+      sleep = [||]; slept = [||]; sfx = [||]; sfy = [||] }
 
-  let empty = {id = Mi.empty; at = Ml.empty}
+  let outside d = d.w * d.h
+
+  let cell_of d i j = if i >= 0 && i < d.w && j >= 0 && j < d.h then i*d.h + j else outside d
+
+  let slot_of i d = try Hashtbl.find d.slot i with Not_found -> -1
  
-  let id i d = if (Mi.mem i d.id) then Some (Mi.find i d.id) else None
-  let ids_at loc d = if (Ml.mem loc d.at) then (Ml.find loc d.at) else []
-  let at loc d = List.fold_left (fun acc i -> match id i d with Some u -> u::acc | _ -> acc) [] (ids_at loc d)
-  let occupied loc d = Ml.mem loc d.at
+  let id i d = let k = slot_of i d in if k < 0 then None else Some d.units.(k)
+
+  (* fold over the units at (i,j) *)
+  let fold_cell d i j f acc =
+    let c = cell_of d i j in
+    let rec next k acc =
+      if k < 0 then acc else
+      ( let u = d.units.(k) in
+        let acc = 
+          if c <> outside d then f acc u else
+          ( let (ui,uj) = u.Unit.loc in if ui = i && uj = j then f acc u else acc ) in
+        next d.next.(k) acc )
+    in
+    next d.head.(c) acc
+
+  (* the cell and its four neighbors *)
+  let fold_nb (i,j) f acc d =
+    acc 
+    |> fold_cell d i j f 
+    |> fold_cell d (i+1) j f |> fold_cell d (i-1) j f 
+    |> fold_cell d i (j+1) f |> fold_cell d i (j-1) f
+  
+  (* pass the slots of the units at (i,j) to f *)
+  let iter_cell_slots d i j f =
+    let c = cell_of d i j in
+    let k = ref d.head.(c) in
+    while !k >= 0 do
+      let kk = !k in
+      k := d.next.(kk);
+      if c <> outside d || (d.li.(kk) = i && d.lj.(kk) = j) then f kk
+    done
+  
+  let ids_at (i,j) d = fold_cell d i j (fun acc u -> u.Unit.id :: acc) []
+  let at (i,j) d = fold_cell d i j (fun acc u -> u::acc) []
+  let occupied (i,j) d = fold_cell d i j (fun _ _ -> true) false
 
   (* list of units uu collides with (they occupy the same loc) *)
   let collisions uu d = 
-    List.fold_left 
-      (fun acc i -> match id i d with Some u when u.Unit.id <> uu.Unit.id -> u::acc | _ -> acc) 
-      [] (ids_at uu.Unit.loc d)
-  (* including neighbors *)
-  let collisions_nb uu d =
-    let loc = uu.Unit.loc in
-    List.fold_left (fun acc1 loc ->
-      List.fold_left 
-        (fun acc2 i -> match id i d with Some u when u.Unit.id <> uu.Unit.id -> u::acc2 | _ -> acc2) 
-        acc1 (ids_at loc d)
-    ) [] [loc; loc ++ (1,0); loc ++ (-1,0); loc ++ (0,1); loc ++ (0,-1)]
-  
+    let (i,j) = uu.Unit.loc in
+    fold_cell d i j (fun acc u -> if u.Unit.id <> uu.Unit.id then u::acc else acc) []
+
+  (* units in the cell of vec and its neighbors *)
   let collisions_nb_vec vec d =
-    let loc = loc_of_vec vec in
-    List.fold_left (fun acc1 loc ->
-      List.fold_left 
-        (fun acc2 i -> match id i d with Some u -> u::acc2 | _ -> acc2) 
-        acc1 (ids_at loc d)
-    ) [] [loc; loc ++ (1,0); loc ++ (-1,0); loc ++ (0,1); loc ++ (0,-1)]
-  
-    
+    fold_nb (loc_of_vec vec) (fun acc u -> u::acc) [] d
+
+  let link d k c =
+    let hd = d.head.(c) in
+    d.cell.(k) <- c;
+    d.prev.(k) <- -1;
+    d.next.(k) <- hd;
+    if hd >= 0 then d.prev.(hd) <- k;
+    d.head.(c) <- k
+
+  let unlink d k =
+    let c = d.cell.(k) and p = d.prev.(k) and n = d.next.(k) in
+    if p >= 0 then d.next.(p) <- n else d.head.(c) <- n;
+    if n >= 0 then d.prev.(n) <- p;
+    d.cell.(k) <- -1
+
+  (* the unit in the free slots, so that the removed units are not kept.
+     It has a random stream of its own and takes no id from the counter *)
+  let blank =
+    let id0 = !Unit.next_id in
+    let u = Rng.use (Rng.of_seed 0) (fun () -> Unit.make 0 Species.(Hum,0) None (0,0)) in
+    Unit.next_id := id0;
+    {u with Unit.id = -1}
+
+  (* double the number of slots, new slots go to the free list *)
+  let grow d =
+    let n = Array.length d.units in
+    let n' = max 16 (2*n) in
+    let extend a x = let a' = Array.make n' x in Array.blit a 0 a' 0 n; a' in
+    let extendf a = let a' = Array.make n' 0.0 in Array.blit a 0 a' 0 n; a' in
+    d.units <- extend d.units blank;
+    d.cell <- extend d.cell (-1);
+    d.next <- extend d.next (-1);
+    d.prev <- extend d.prev (-1);
+    d.ids <- extend d.ids (-1);
+    d.li <- extend d.li 0;
+    d.lj <- extend d.lj 0;
+    d.px <- extendf d.px;
+    d.py <- extendf d.py;
+    d.vx <- extendf d.vx;
+    d.vy <- extendf d.vy;
+    d.mass <- extendf d.mass;
+    d.radius <- extendf d.radius;
+    d.fx <- extendf d.fx;
+    d.fy <- extendf d.fy;
+    d.prevx <- extendf d.prevx;
+    d.prevy <- extendf d.prevy;
+    d.sleep <- extendf d.sleep;
+    d.slept <- extendf d.slept;
+    d.sfx <- extendf d.sfx;
+    d.sfy <- extendf d.sfy;
+    for k = n'-1 downto n do
+      d.next.(k) <- d.free;
+      d.free <- k
+    done
 
   let rm ru d =
     let i = ru.Unit.id in
-    match id i d with
-    | Some u ->
-        let loc = u.Unit.loc in
-        let d_id = Mi.remove i d.id in
-        let d_at = 
-        ( match List.filter ((<>)i) (ids_at loc d) with
-          | [] -> Ml.remove loc d.at
-          | ls -> Ml.add loc ls d.at ) in
-        {id=d_id; at=d_at}
-    | None -> d
+    let k = slot_of i d in
+    if k >= 0 then
+    ( unlink d k;
+      Hashtbl.remove d.slot i;
+      d.units.(k) <- blank;
+      d.ids.(k) <- -1;
+      d.li.(k) <- 0;
+      d.lj.(k) <- 0;
+      d.px.(k) <- 0.0;
+      d.py.(k) <- 0.0;
+      d.vx.(k) <- 0.0;
+      d.vy.(k) <- 0.0;
+      d.mass.(k) <- 0.0;
+      d.radius.(k) <- 0.0;
+      d.fx.(k) <- 0.0;
+      d.fy.(k) <- 0.0;
+      d.prevx.(k) <- 0.0;
+      d.prevy.(k) <- 0.0;
+      d.sleep.(k) <- 0.0;
+      d.slept.(k) <- 0.0;
+      d.sfx.(k) <- 0.0;
+      d.sfy.(k) <- 0.0;
+      d.next.(k) <- d.free;
+      d.free <- k );
+    d
   
-  let upd u d = 
-    let d1 = rm u d in
-    let i = u.Unit.id in
-    let loc = u.Unit.loc in
-    let d2_at = Ml.add loc (i :: ids_at loc d1) d1.at in
-    let d2_id = Mi.add i u d1.id in
-    {at = d2_at; id = d2_id}
+  let store d k u =
+    let (i,j) = u.Unit.loc and (px,py) = u.Unit.pos and (vx,vy) = u.Unit.vel in
+    d.units.(k) <- u;
+    d.ids.(k) <- u.Unit.id;
+    d.li.(k) <- i;
+    d.lj.(k) <- j;
+    d.px.(k) <- px;
+    d.py.(k) <- py;
+    d.vx.(k) <- vx;
+    d.vy.(k) <- vy;
+    d.mass.(k) <- Unit.get_total_mass u;
+    d.radius.(k) <- Unit.get_radius u
 
-  let iter f d = Mi.iter (fun k u -> f u) d.id
-
-  let fold f acc d = Mi.fold (fun k u acc -> f acc u) d.id acc
+  let upd u d = 
+    let (i,j) = u.Unit.loc in
+    let c = cell_of d i j in
+    let k = slot_of u.Unit.id d in
+    if k >= 0 then
+    ( if d.cell.(k) <> c then (unlink d k; link d k c);
+      store d k u;
+      (* changed from outside (e.g. damaged), wake up *)
+      d.sleep.(k) <- 0.0 )
+    else
+    ( if d.free < 0 then grow d;
+      let k = d.free in
+      d.free <- d.next.(k);
+      link d k c;
+      store d k u;
+      d.fx.(k) <- 0.0;
+      d.fy.(k) <- 0.0;
+      d.prevx.(k) <- d.px.(k);
+      d.prevy.(k) <- d.py.(k);
+      d.sleep.(k) <- 0.0;
+      d.slept.(k) <- 0.0;
+      Hashtbl.replace d.slot u.Unit.id k );
+    d
+
+  (* the unit sleeps for the time t, unless woken earlier *)
+  let put_to_sleep u t d =
+    let k = slot_of u.Unit.id d in
+    if k >= 0 then
+    ( d.sleep.(k) <- t;
+      d.sfx.(k) <- d.fx.(k);
+      d.sfy.(k) <- d.fy.(k) )
+
+  (* pass the time dt for a sleeping unit, false if it is awake *)
+  let doze dt u d =
+    let k = slot_of u.Unit.id d in
+    k >= 0 && d.sleep.(k) > 0.0 &&
+    ( d.sleep.(k) <- max 0.0 (d.sleep.(k) -. dt);
+      d.slept.(k) <- d.slept.(k) +. dt;
+      true )
+
+  (* the time the unit slept through, it is reset *)
+  let take_slept u d =
+    let k = slot_of u.Unit.id d in
+    if k < 0 then 0.0 else
+    ( let t = d.slept.(k) in
+      d.slept.(k) <- 0.0;
+      t )
+
+  (* the largest radius of the units *)
+  let max_radius d =
+    let r = ref 0.0 in
+    for k = 0 to Array.length d.units - 1 do
+      if d.cell.(k) >= 0 && d.radius.(k) > !r then r := d.radius.(k)
+    done;
+    !r
+
+  (* remember the positions before a step *)
+  let save_prev d =
+    Array.blit d.px 0 d.prevx 0 (Array.length d.px);
+    Array.blit d.py 0 d.prevy 0 (Array.length d.py)
+
+  (* position of u between the previous and the current step, 0 <= alpha <= 1 *)
+  let interpolated_pos alpha u d =
+    let k = slot_of u.Unit.id d in
+    if k < 0 then u.Unit.pos else
+    ( let (px, py) = u.Unit.pos in
+      (d.prevx.(k) +. alpha *. (px -. d.prevx.(k)), d.prevy.(k) +. alpha *. (py -. d.prevy.(k))) )
+
+  (* f must not modify d *)
+  let iter f d = 
+    for k = 0 to Array.length d.units - 1 do
+      if d.cell.(k) >= 0 then f d.units.(k)
+    done
+
+  (* the units are collected first, so f may modify d *)
+  let fold f acc d = 
+    let ls = ref [] in
+    for k = Array.length d.units - 1 downto 0 do
+      if d.cell.(k) >= 0 then ls := d.units.(k) :: !ls
+    done;
+    List.fold_left f acc !ls
 end
 
 
@@ -892,11 +1284,11 @@ module R = struct
 
     type energy_spot = loc * float
 
-    type t = {projls:Proj.t list; stairsls: stairs list; posobj: (pos_obj_type option) Area.t; 
+    type t = {projs: Projs.t; stairsls: stairs list; posobj: (pos_obj_type option) Area.t; 
       movls : movable_obj list; 
       energyspots : (energy_spot * float) list 
     }
-    let empty w h = {projls=[]; stairsls = []; posobj = Area.make w h None; movls = []; energyspots = []}
+    let empty w h = {projs = Projs.make (); stairsls = []; posobj = Area.make w h None; movls = []; energyspots = []}
   end
 
   module Zone = struct
@@ -911,7 +1303,7 @@ module R = struct
 
   type t = {
     rid: region_id; 
-    a: Tile.t Area.t;
+    a: Tiles.t;
     loc0: loc;
     e: E.t; 
     explored: (Tile.t option) Area.t; 
@@ -957,8 +1349,8 @@ end
 
 (* Utilities *)
 let find_location a pred = 
-  let w = Area.w a in
-  let h = Area.h a in
+  let w = Tiles.w a in
+  let h = Tiles.h a in
   let rec attempt n =
     let loc = Random.int w, Random.int h in
     if pred n loc then
@@ -971,7 +1363,7 @@ let find_location a pred =
 let find_walkable_location_a_e a e =
   find_location a 
     ( fun n loc -> 
-        let c1 = Tile.can_walk (Tile.classify (Area.get a loc)) in
+        let c1 = Tiles.can_walk a loc in
         let c2 = not (E.occupied loc e) in
         c1 && (n > 50 || c2) )
 
@@ -982,7 +1374,7 @@ let find_walkable_location_reg reg =
 let find_walkable_location_zone_a_e_z zone a e z =
   find_location a 
     ( fun n loc -> 
-        let c1 = Tile.can_walk (Tile.classify (Area.get a loc)) in
+        let c1 = Tiles.can_walk a loc in
         let c2 = not (E.occupied loc e) in
         let c22 = R.Zone.check z loc zone in
         c1 && (n > 50 || (c2 && c22)) )
@@ -994,7 +1386,7 @@ let find_placement_location area obj =
   find_location 
     area 
     ( fun n loc -> 
-        let c1 = Tile.can_walk (Tile.classify (Area.get area loc)) in
+        let c1 = Tiles.can_walk area loc in
         let c2 = not (List.exists (fun (_,locx) -> loc = locx) obj.R.Obj.stairsls) in
         c2 && (n > 50 || c1) )
 
@@ -1006,7 +1398,7 @@ let find_entry_loc (i,j) edge reg1 reg2 obj2 =
     let loc2 = loc ++ i %% d2 in
     if is_walkable area loc1 then Some loc1 else
     if is_walkable area loc2 then Some loc2 else
-    ( if Area.is_within area (loc1++d1) || Area.is_within area (loc2++d2) then
+    ( if Tiles.is_within area (loc1++d1) || Tiles.is_within area (loc2++d2) then
         search loc d1 d2 (i+1)
       else 
         None
@@ -1019,9 +1411,9 @@ let find_entry_loc (i,j) edge reg1 reg2 obj2 =
   in
   match edge with
   | East -> search (0,j) (0,1) (0,-1) 0
-  | West -> search (Area.w area - 1, j) (0,-1) (0,1) 0
+  | West -> search (Tiles.w area - 1, j) (0,-1) (0,1) 0
   | North -> search (i,0) (-1,0) (1,0) 0
-  | South -> search (i, Area.h area - 1) (1,0) (-1,0) 0
+  | South -> search (i, Tiles.h area - 1) (1,0) (-1,0) 0
   | Up -> search_stairs R.Obj.StairsDown obj2.R.Obj.stairsls
   | Down -> search_stairs R.Obj.StairsUp obj2.R.Obj.stairsls
   | _ -> None
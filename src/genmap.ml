@@ -792,7 +792,8 @@ module Cube = struct
     {currid; prio; rm = rm_arr; loc = rloc_arr; nb = nb_arr}
 
 
-  let generate w h depth facnum =
+  (* the stages of generate are exposed separately for benchmarking *)
+  let prepare w h depth =
     let altitude = gen_rnd_alt_2 w h 2 in
     let forestation = gen_rnd_alt w h 2 in
     let (_,_,m) as b_cc_m = initial w h depth altitude forestation in
@@ -823,12 +824,16 @@ module Cube = struct
       ) m
     in
     
-    let b_cc_m = 
-      b_cc_m 
-      |> connect_everything  
-      |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon 
-      |> dig_tunnel |> dig_tunnel |> dig_tunnel |> dig_tunnel in
-    
+    (altitude, forestation, b_cc_m, m_bonuses)
+
+  let dig b_cc_m =
+    b_cc_m 
+    |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon |> dig_deep_dungeon 
+    |> dig_tunnel |> dig_tunnel |> dig_tunnel |> dig_tunnel
+
+  let generate w h depth facnum =
+    let altitude, forestation, b_cc_m, m_bonuses = prepare w h depth in
+    let b_cc_m = b_cc_m |> connect_everything |> dig in
     geo_of_cube facnum altitude forestation b_cc_m m_bonuses 
 
 
@@ -54,22 +54,22 @@ let constructors_house =
 
 
 let add_cons area rm =
-  let w = Area.w area in
-  let h = Area.h area in
+  let w = Tiles.w area in
+  let h = Tiles.h area in
   let sq (x,y) (dx, dy) =
     for i = x to x + dx do
       for j = y to y + dy do
         if (i=x || i=x+dx || j = y || j =y+dy) then
-          Area.set area (i,j) Tile.Wall
+          Tiles.set area (i,j) Tile.Wall
         else
-          Area.set area (i,j) Tile.WoodenFloor
+          Tiles.set area (i,j) Tile.WoodenFloor
       done
     done;
     let op_door = Tile.Door Tile.IsOpen in
-    Area.set area (x,y+dy/2) op_door;
-    Area.set area (x+dx,y+dy/2) op_door;
-    Area.set area (x+dx/2,y) op_door;
-    Area.set area (x+dx/2,y+dy) op_door;
+    Tiles.set area (x,y+dy/2) op_door;
+    Tiles.set area (x+dx,y+dy/2) op_door;
+    Tiles.set area (x+dx/2,y) op_door;
+    Tiles.set area (x+dx/2,y+dy) op_door;
   in
   List.iter (fun {RM.constype=ct; RM.consloc=loc} ->
     let xy () = Random.int ((w/2 - 4)/2), Random.int ((h/2 - 4)/2) in
@@ -87,15 +87,15 @@ let add_cons area rm =
 let fill a tile (x,y,dx,dy)  =
   for i = x to x+dx-1 do
     for j = y to y+dy-1 do
-      Area.set a (i,j) tile
+      Tiles.set a (i,j) tile
     done
   done
 
 let maze a wall floor (x,y,dx,dy) =
-  let w = Area.w a in
-  let h = Area.h a in
-  let set = Area.set a in
-  let get = Area.get a in
+  let w = Tiles.w a in
+  let h = Tiles.h a in
+  let set = Tiles.set a in
+  let get = Tiles.get a in
   let z = Array.make_matrix w h false in
   let nb8 (i,j) = 
     List.filter (fun (ii,jj) -> ii>=x && jj>=y && ii<x+dx && jj<y+dy) 
@@ -160,7 +160,7 @@ let build_dungeon cons charmap none_tile w h wtogen htogen =
       let actualw = Carve.(res.rect.Rect.w) in
       let actualh = Carve.(res.rect.Rect.h) in
         
-      let a = Area.make (actualw+2) (actualh+2) none_tile in
+      let a = Tiles.make (actualw+2) (actualh+2) none_tile in
       
       let x0 = (w - actualw) / 2 in
       let y0 = (h - actualh) / 2 in
@@ -173,11 +173,11 @@ let build_dungeon cons charmap none_tile w h wtogen htogen =
               Some c -> charmap c
             | None -> none_tile
           in
-          Area.set a (i+1,j+1) t
+          Tiles.set a (i+1,j+1) t
         done
       done;
       (a, (x0,y0))
-  | None -> Area.make w h none_tile, (0,0)
+  | None -> Tiles.make w h none_tile, (0,0)
 
 let add_house a zones ground_tile (start_x, start_y) wtogen htogen =
   let (info,_) as cons = constructors_house.(0) in
@@ -202,9 +202,9 @@ let add_house a zones ground_tile (start_x, start_y) wtogen htogen =
           let unblock (i,j) = 
             for ii = i-1 to i+1 do
               for jj = j-1 to j+1 do
-                if Area.is_within a (ii,jj) then 
-                ( if Area.get a (ii,jj) |> Tile.classify |> Tile.can_walk = false then
-                    Area.set a (ii,jj) ground_tile
+                if Tiles.is_within a (ii,jj) then 
+                ( if not (Tiles.can_walk a (ii,jj)) then
+                    Tiles.set a (ii,jj) ground_tile
                 )
               done
             done
@@ -223,7 +223,7 @@ let add_house a zones ground_tile (start_x, start_y) wtogen htogen =
                   let t = charmap_std c in
                   let ij = (start_x+i, start_y+j) in
                   if Tile.classify t <> Tile.CWall then R.Zone.mark zones ij (R.Zone.Cons RM.CHouse);
-                  Area.set a ij t
+                  Tiles.set a ij t
 
               | None -> ()
             done
@@ -238,29 +238,29 @@ let add_market a zones ground_tile (start_x, start_y) wtogen htogen =
     for i = x to x + dx do
       for j = y to y + dy do
         if (i=x || i=x+dx) && (j = y || j =y+dy) then
-          Area.set a (i,j) (Tile.MarketStand (Random.int 6))
+          Tiles.set a (i,j) (Tile.MarketStand (Random.int 6))
         else
         ( R.Zone.mark zones (i,j) (R.Zone.Cons RM.CMarket);
-          Area.set a (i,j) ground_tile
+          Tiles.set a (i,j) ground_tile
         )
       done
     done;
     (*
     let op_door = Tile.Door Tile.IsOpen in
-    Area.set a (x,y+dy/2) op_door;
-    Area.set a (x+dx,y+dy/2) op_door;
-    Area.set a (x+dx/2,y) op_door;
-    Area.set a (x+dx/2,y+dy) op_door;
+    Tiles.set a (x,y+dy/2) op_door;
+    Tiles.set a (x+dx,y+dy/2) op_door;
+    Tiles.set a (x+dx/2,y) op_door;
+    Tiles.set a (x+dx/2,y+dy) op_door;
     *)
   in
   sq (start_x, start_y) (wtogen-1, htogen-1)
 
-let gen pol edges_func rid rm astr =
-
-  let prng_state = Random.get_state() in
+(* static layers of a region: tiles, zones, stairs and positional objects.
+   They depend only on the region's exits and its meta info (seed, constructions, specials) *)
+type static_layers = {s_a: Tiles.t; s_loc0: loc; s_zones: Zone.t; s_obj: Obj.t}
 
-  (* set the seed *)
-  Random.init rm.RM.seed;
+(* generate the static layers, the random number generator must be already seeded *)
+let gen_static edges_func rm =
 
   let ground_tile = match rm.RM.biome with
     | RM.Mnt | RM.ForestMnt -> Tile.RockyGround
@@ -302,17 +302,17 @@ let gen pol edges_func rid rm astr =
         (* maze a Tile.DungeonWall Tile.DungeonFloor (1,1,w-2,h-2); *)
         let cons = take_any constructors_cave in
         build_dungeon cons charmap_inv_cave Tile.CaveWall w h (w-2) (h-2)
-    | _ -> Area.init w h (fun _ _ -> any_from_prob_ls prob_ls ), (0,0) in
+    | _ -> Tiles.init w h (fun _ _ -> any_from_prob_ls prob_ls ), (0,0) in
 
 
   (* add N, S, W, E exits *)
   List.iter 
     ( fun (dir, loc0, dloc) ->
         if edges_func dir then
-        ( let not_a_floor loc = Area.is_within area loc && not ((Area.get area loc |> Tile.classify) = Tile.CFloor) in
+        ( let not_a_floor loc = Tiles.is_within area loc && not ((Tiles.get area loc |> Tile.classify) = Tile.CFloor) in
           let rec repeat loc =
             if not_a_floor loc then
-            ( Area.set area loc ground_tile;
+            ( Tiles.set area loc ground_tile;
               
               if (List.for_all (fun d -> (d++dloc = (0,0)) || not_a_floor (loc++d)) [(1,0); (-1,0); (0,1); (0,-1)]) then
                 repeat (loc ++ dloc)
@@ -323,7 +323,7 @@ let gen pol edges_func rid rm astr =
           repeat loc0
         )
     ) 
-    ( let x = Area.w area - 1 in let y = Area.h area - 1 in 
+    ( let x = Tiles.w area - 1 in let y = Tiles.h area - 1 in 
       [ (North, (x/2, y), ( 0,-1));
         (South, (x/2, 0), ( 0, 1));
         (East,  (x, y/2), (-1, 0));
@@ -343,19 +343,19 @@ let gen pol edges_func rid rm astr =
                 for y = y0 to y1 do
                   for i = 0 to 0 + Random.int 2 + Random.int 2 + Random.int 2 do
                     let loc = (x + i*dx, y + i*dy) in
-                    let t = Area.get area loc in
+                    let t = Tiles.get area loc in
                     if t |> Tile.classify |> Tile.can_walk then
                     ( match Random.int (i+1) with
-                      | 0 -> Area.set area (x + i*dx,y + i*dy) (Tile.BigRock (Random.int 4));
-                      | 1 -> Area.set area (x + i*dx,y + i*dy) (if Random.int 2 = 0 then Tile.Rock1 else Tile.Rock2);
-                      | _ -> Area.set area (x + i*dx,y + i*dy) (if Random.int 2 = 0 then Tile.Tree2 else Tile.Tree2);
+                      | 0 -> Tiles.set area (x + i*dx,y + i*dy) (Tile.BigRock (Random.int 4));
+                      | 1 -> Tiles.set area (x + i*dx,y + i*dy) (if Random.int 2 = 0 then Tile.Rock1 else Tile.Rock2);
+                      | _ -> Tiles.set area (x + i*dx,y + i*dy) (if Random.int 2 = 0 then Tile.Tree2 else Tile.Tree2);
                     )
                   done
                 done
               done
         )
     )
-    ( let x = Area.w area - 1 in let y = Area.h area - 1 in 
+    ( let x = Tiles.w area - 1 in let y = Tiles.h area - 1 in 
       [ North, 0, y, x, y, 0, -1;
         South, 0, 0, x, 0, 0, 1;
         East, x, 0, x, y, -1, 0;
@@ -366,12 +366,12 @@ let gen pol edges_func rid rm astr =
   (* add constructions *)
   (* add_cons area rm; *)
   let zones =
-    let zones = Area.make (Area.w area) (Area.h area) R.Zone.S.empty in
+    let zones = Area.make (Tiles.w area) (Tiles.h area) R.Zone.S.empty in
 
     let midgapx = 3 in 
     let midgapy = 2 in 
-    let housew = (Area.w area - 2 - midgapx)/2 in
-    let househ = (Area.h area - 2 - midgapy)/2 in
+    let housew = (Tiles.w area - 2 - midgapx)/2 in
+    let househ = (Tiles.h area - 2 - midgapy)/2 in
     let permutations =
       let a = [|(1,1); (1,1 + househ + midgapy); (1 + housew + midgapx,1); (1 + housew + midgapx, 1 + househ + midgapy)|] in
       array_permute a;
@@ -389,11 +389,11 @@ let gen pol edges_func rid rm astr =
   (* add specials *)
   List.iter (function 
     | RM.BonusTower b ->
-        Area.set area (Area.w area / 2, Area.h area / 2) (Tile.BonusTower b);
+        Tiles.set area (Tiles.w area / 2, Tiles.h area / 2) (Tile.BonusTower b);
   ) rm.RM.specials;
 
   (* add stairs *)
-  let obj = Obj.empty (Area.w area) (Area.h area) in
+  let obj = Obj.empty (Tiles.w area) (Tiles.h area) in
   let obj = 
     if edges_func Down then
       let loc = find_placement_location area obj in
@@ -409,9 +409,9 @@ let gen pol edges_func rid rm astr =
 
   (* add doors and other positional objects from the generated map *)
   let _ =
-    for i = 0 to (Area.w area) - 1 do
-      for j = 0 to (Area.h area) - 1 do
-        let tile = Area.get area (i,j) in
+    for i = 0 to (Tiles.w area) - 1 do
+      for j = 0 to (Tiles.h area) - 1 do
+        let tile = Tiles.get area (i,j) in
         let cl = tile |> Tile.classify in
         match cl with
         | Tile.CDoor Tile.IsOpen ->
@@ -428,10 +428,79 @@ let gen pol edges_func rid rm astr =
     done 
   in
 
-  let explored = Area.make (Area.w area) (Area.h area) None in
- 
-  (* restart random number initializer *)
-  Random.set_state prng_state;
+  {s_a = area; s_loc0 = loc0; s_zones = zones; s_obj = obj}
+
+(* Bounded LRU cache of the static layers, so that a region dropped from Prio and
+   entered again is not carved from scratch. The key contains everything the layers
+   depend on, so a stale entry (e.g. from another world) is never returned *)
+module Cache = struct
+  type key = region_id * int * edge_type list * RM.construction list * RM.special_property list
+
+  let capacity = 32
+
+  (* value and the time of the last use *)
+  let tbl : (key, static_layers * int ref) Hashtbl.t = Hashtbl.create capacity
+  let clock = ref 0
+
+  let key edges_func rid rm =
+    let exits = List.filter edges_func [East; North; West; South; Up; Down] in
+    (rid, rm.RM.seed, exits, rm.RM.cons, rm.RM.specials)
+
+  (* doors and bonus towers are toggled in place, so the cached layers are never given away *)
+  let copy sl =
+    {sl with s_a = Tiles.copy sl.s_a; s_zones = Area.copy sl.s_zones;
+      s_obj = {sl.s_obj with Obj.posobj = Area.copy sl.s_obj.Obj.posobj; Obj.projs = Projs.make ()}}
+
+  let evict_oldest () =
+    let oldest = Hashtbl.fold (fun k (_, t) acc ->
+        match acc with
+        | Some (_, t') when t' <= !t -> acc
+        | _ -> Some (k, !t)
+      ) tbl None in
+    match oldest with
+    | Some (k, _) -> Hashtbl.remove tbl k
+    | None -> ()
+
+  let mem edges_func rid rm = Hashtbl.mem tbl (key edges_func rid rm)
+
+  let find edges_func rid rm =
+    incr clock;
+    try
+      let sl, t = Hashtbl.find tbl (key edges_func rid rm) in
+      t := !clock;
+      Some (copy sl)
+    with Not_found -> None
+
+  let add edges_func rid rm sl =
+    if Hashtbl.length tbl >= capacity then evict_oldest ();
+    Hashtbl.replace tbl (key edges_func rid rm) (copy sl, ref !clock)
+end
+
+(* generate and cache the static layers, they get their own stream seeded by the region *)
+let gen_static_cached edges_func rid rm =
+  let sl = Rng.use (Rng.of_seed rm.RM.seed) (fun () -> gen_static edges_func rm) in
+  Cache.add edges_func rid rm sl;
+  sl
+
+(* Generate the static layers of a region in advance, so that gen finds them in the cache.
+   Returns false if they are cached already *)
+let prefetch edges_func rid rm =
+  if Cache.mem edges_func rid rm then
+    false
+  else
+  ( ignore (gen_static_cached edges_func rid rm);
+    true )
+
+(* the region with its units and items, the static layers come from the cache *)
+let gen_region pol edges_func rid rm astr =
+
+  let {s_a = area; s_loc0 = loc0; s_zones = zones; s_obj = obj} =
+    match Cache.find edges_func rid rm with
+    | Some sl -> sl
+    | None -> gen_static_cached edges_func rid rm
+  in
+
+  let explored = Area.make (Tiles.w area) (Tiles.h area) None in
  
   let fac_arr, units_to_gen = 
     let total = Array.fold_left (fun sum v -> sum + v) 0 rm.RM.lat.Mov.fac in
@@ -469,14 +538,14 @@ let gen pol edges_func rid rm astr =
                 find_walkable_location_zone_a_e_z (R.Zone.Cons RM.CMarket) area e_acc zones
             | _ -> find_walkable_location_a_e area e_acc 
           in
-          if Tile.can_walk (Tile.classify (Area.get area loc)) then
+          if Tiles.can_walk area loc then
           ( let u = Org.Actor.make_unit a loc in
             E.upd u e_acc 
           )
           else
             e_acc
       )
-      E.empty
+      (E.make (Tiles.w area) (Tiles.h area))
       astr
   in
 
@@ -485,7 +554,7 @@ let gen pol edges_func rid rm astr =
     fold_lim (fun (e_acc, mov_acc) i -> 
       (* let loc = Random.int w, Random.int h in *)
       let loc = find_walkable_location_a_e area e_acc in
-      if Tile.can_walk (Tile.classify (Area.get area loc)) && not (E.occupied loc e_acc) then
+      if Tiles.can_walk area loc && not (E.occupied loc e_acc) then
       ( let fac = fac_arr.(i) in
         let sp = match any_from_ls pol.Pol.prop.(fac).Pol.speciesls with 
           | Some sp -> upgrade rm sp 
@@ -512,8 +581,9 @@ let gen pol edges_func rid rm astr =
   
   (* randomly drop items, spend more resources *)
   let make_optinv res =
-    let a = Area.make (Area.w area) (Area.h area) None in
+    let a = Area.make (Tiles.w area) (Tiles.h area) None in
     let is_a_dungeon = rm.RM.biome = RM.Dungeon in
+    let no_units = E.make (Tiles.w area) (Tiles.h area) in
     let rec distribute res =
       let obj = Item.Coll.random None in
       let price = Item.decompose obj in
@@ -522,8 +592,8 @@ let gen pol edges_func rid rm astr =
           ( is_a_dungeon ||
             ( Random.float 1.0 < exp(float (-price_num) /. float Item.Coll.cheap_price) ) ) then
       ( (* let loc = (Random.int w, Random.int h) in *)
-        let loc = find_walkable_location_a_e area E.empty in
-        if Tile.classify (Area.get area loc) = Tile.CFloor then
+        let loc = find_walkable_location_a_e area no_units in
+        if Tiles.classify area loc = Tile.CFloor then
         ( let optinv = Area.get a loc in
           match (Inv.ground_drop obj optinv) with 
             Some upd_optinv -> 
@@ -552,4 +622,12 @@ let gen pol edges_func rid rm astr =
 
   ({rid=rid; a=area; e=ue; explored; optinv; zones; obj; loc0}, rm')
 
+(* key of the stream of the units and items, the static layers use Rng.of_seed *)
+let rng_key_dynamic = 1
+
+(* The region is generated from its seed only: the units and items get a stream 
+   of their own, whatever the caller's random state is *)
+let gen pol edges_func rid rm astr =
+  Rng.use (Rng.derive [|rm.RM.seed; rid; rng_key_dynamic|]) (fun () -> gen_region pol edges_func rid rm astr)
+
 (* generation gunction ends *)
@@ -60,6 +60,24 @@ let prio_bump pol astr edge_func addrid rmarr pl =
 
 open G
 
+(* Idle-time prefetch for a move in the direction dir: the static layers of the
+   regions that move would generate (the neighbor and its neighbors missing in Prio)
+   are built ahead of time, one region per call. Returns false if nothing is left to do *)
+let prefetch dir g =
+  match get_nb g g.currid dir with
+  | Some nrid ->
+      let rec first = function
+        | rid :: tl ->
+            let edge_func dir = Me.mem dir g.nb.(rid) in
+            if Prio.get rid g.prio = None && Genreg.prefetch edge_func rid g.rm.(rid) then
+              true
+            else
+              first tl
+        | [] -> false
+      in
+      first (nrid :: get_only_nb_rid_ls nrid g)
+  | None -> false
+
 (* move your current region *)
 let move pol astr dir g =
   let nb = g.nb.(g.currid) in
@@ -109,6 +109,114 @@ module TxInfo = struct
     {x1; y1; x2; y2; basew; baseh; dx; dy; iw; ih}
 end
 
+(* Quads are collected in vertex arrays and drawn by one glDrawArrays call
+   when flushed, instead of a dozen immediate mode calls per quad.
+   The color is per vertex, so set_color does not break the batch.
+   
+   The quads drawn by a function can also be recorded into a segment and
+   replayed later (static parts of the scene), without being computed again *)
+module Batch = struct
+  open Bigarray
+
+  type buf = {
+    mutable vert: float_array;
+    mutable texc: float_array;
+    mutable col: float_array;
+    mutable len: int; (* quads *)
+  }
+
+  (* recorded quads and the current color after them *)
+  type segment = {quads: buf; color: float * float * float * float}
+
+  let capacity = 8192 (* quads *)
+
+  let make_buf n = 
+    { vert = Array1.create float32 c_layout (n * 8);
+      texc = Array1.create float32 c_layout (n * 8);
+      col = Array1.create float32 c_layout (n * 16);
+      len = 0 }
+
+  let main = make_buf capacity
+
+  (* the buffer being filled: main or a segment being recorded *)
+  let cur = ref main
+
+  let cr = ref 1.0
+  let cg = ref 1.0
+  let cb = ref 1.0
+  let ca = ref 1.0
+
+  let set_color r g b a = cr := r; cg := g; cb := b; ca := a
+
+  let draw b =
+    if b.len > 0 then
+    ( glVertexPointer 2 gl_float 0 b.vert;
+      glTexCoordPointer 2 gl_float 0 b.texc;
+      glColorPointer 4 gl_float 0 b.col;
+      glDrawArrays gl_quads 0 (4 * b.len) )
+
+  let flush () =
+    draw main;
+    main.len <- 0
+
+  let grow b =
+    let extend a = 
+      let a' = Array1.create float32 c_layout (2 * Array1.dim a) in
+      Array1.blit a (Array1.sub a' 0 (Array1.dim a)); 
+      a' in
+    b.vert <- extend b.vert;
+    b.texc <- extend b.texc;
+    b.col <- extend b.col
+
+  let vertex b k tx ty x y =
+    b.vert.{2*k} <- float x;
+    b.vert.{2*k+1} <- float y;
+    b.texc.{2*k} <- tx;
+    b.texc.{2*k+1} <- ty;
+    b.col.{4*k} <- !cr;
+    b.col.{4*k+1} <- !cg;
+    b.col.{4*k+2} <- !cb;
+    b.col.{4*k+3} <- !ca
+
+  (* texture (tx1,ty1)-(tx2,ty2) on the quad (x0,y0)-(x1,y1), ty2 is at the bottom *)
+  let quad tx1 ty1 tx2 ty2 x0 y0 x1 y1 =
+    let b = !cur in
+    if 8 * b.len >= Array1.dim b.vert then
+    ( if b == main then flush () else grow b );
+    let k = 4 * b.len in
+    vertex b k     tx1 ty2 x0 y0; (* Bottom Left Of The Texture and Quad *)
+    vertex b (k+1) tx2 ty2 x1 y0; (* Bottom Right Of The Texture and Quad *)
+    vertex b (k+2) tx2 ty1 x1 y1; (* Top Right Of The Texture and Quad *)
+    vertex b (k+3) tx1 ty1 x0 y1; (* Top Left Of The Texture and Quad *)
+    b.len <- b.len + 1
+
+  (* record the quads drawn by f into a segment, they are not drawn *)
+  let record f =
+    let b = make_buf 64 in
+    let prev = !cur in
+    cur := b;
+    ( try f () with e -> cur := prev; raise e );
+    cur := prev;
+    {quads = b; color = (!cr, !cg, !cb, !ca)}
+
+  (* draw the recorded quads (not while recording), 
+     the current color is set as it was after recording *)
+  let replay seg =
+    let b = seg.quads in
+    if b.len > capacity then
+    ( flush (); draw b )
+    else if b.len > 0 then
+    ( if main.len + b.len > capacity then flush ();
+      let copy src dst per_quad = 
+        Array1.blit (Array1.sub src 0 (per_quad * b.len)) (Array1.sub dst (per_quad * main.len) (per_quad * b.len)) in
+      copy b.vert main.vert 8;
+      copy b.texc main.texc 8;
+      copy b.col main.col 16;
+      main.len <- main.len + b.len );
+    let (r, g, b, a) = seg.color in
+    set_color r g b a
+end
+
 module Predraw = struct
   open TxInfo
 
@@ -117,20 +225,14 @@ module Predraw = struct
     let vy = vy + tx.dy * z in
     let vx1 = vx + tx.iw * z in
     let vy1 = vy + tx.ih * z in
-    glTexCoord2f tx.x1.(ti).(tj) tx.y2.(ti).(tj);    glVertex2i  vx   vy; (* Bottom Left Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti).(tj) tx.y2.(ti).(tj);    glVertex2i  vx1  vy; (* Bottom Right Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti).(tj) tx.y1.(ti).(tj);    glVertex2i  vx1 vy1; (* Top Right Of The Texture and Quad *)
-    glTexCoord2f tx.x1.(ti).(tj) tx.y1.(ti).(tj);    glVertex2i  vx  vy1  (* Top Left Of The Texture and Quad *)
+    Batch.quad tx.x1.(ti).(tj) tx.y1.(ti).(tj) tx.x2.(ti).(tj) tx.y2.(ti).(tj) vx vy vx1 vy1
   
   let subimagei_stretch_wh (sx,sy) w h z tx (ti, tj) (vx, vy) =
     let vx = vx + tx.dx * z * sx in
     let vy = vy + tx.dy * z * sy in
     let vx1 = vx + (tx.iw + tx.basew*(w-1)) * z * sx in
     let vy1 = vy + (tx.ih + tx.baseh*(h-1)) * z * sy in
-    glTexCoord2f tx.x1.(ti).(tj+h-1)     tx.y2.(ti).(tj+h-1);      glVertex2i  vx   vy; (* Bottom Left Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti+w-1).(tj+h-1) tx.y2.(ti+w-1).(tj+h-1);  glVertex2i  vx1  vy; (* Bottom Right Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti+w-1).(tj)     tx.y1.(ti+w-1).(tj);      glVertex2i  vx1 vy1; (* Top Right Of The Texture and Quad *)
-    glTexCoord2f tx.x1.(ti).(tj)         tx.y1.(ti).(tj);          glVertex2i  vx  vy1  (* Top Left Of The Texture and Quad *)
+    Batch.quad tx.x1.(ti).(tj) tx.y1.(ti).(tj) tx.x2.(ti+w-1).(tj) tx.y2.(ti).(tj+h-1) vx vy vx1 vy1
   
   let subimagei_wh = subimagei_stretch_wh (1,1)
   
@@ -141,20 +243,14 @@ module Predraw = struct
     let vy = round vy + tx.dy * z in
     let vx1 = vx + tx.iw * z in
     let vy1 = vy + tx.ih * z in
-    glTexCoord2f tx.x1.(ti).(tj) tx.y2.(ti).(tj);  glVertex2i  vx   vy; (* Bottom Left Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti).(tj) tx.y2.(ti).(tj);  glVertex2i  vx1  vy; (* Bottom Right Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti).(tj) tx.y1.(ti).(tj);  glVertex2i  vx1 vy1; (* Top Right Of The Texture and Quad *)
-    glTexCoord2f tx.x1.(ti).(tj) tx.y1.(ti).(tj);  glVertex2i  vx  vy1  (* Top Left Of The Texture and Quad *)
+    Batch.quad tx.x1.(ti).(tj) tx.y1.(ti).(tj) tx.x2.(ti).(tj) tx.y2.(ti).(tj) vx vy vx1 vy1
   
   let subimagef_wh w h z tx (ti, tj) (vx, vy) =
     let vx = round vx + tx.dx * z in
     let vy = round vy + tx.dy * z in
     let vx1 = vx + tx.iw * w * z in
     let vy1 = vy + tx.ih * h * z in
-    glTexCoord2f tx.x1.(ti).(tj+h-1)     tx.y2.(ti).(tj+h-1);      glVertex2i  vx   vy; (* Bottom Left Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti+w-1).(tj+h-1) tx.y2.(ti+w-1).(tj+h-1);  glVertex2i  vx1  vy; (* Bottom Right Of The Texture and Quad *)
-    glTexCoord2f tx.x2.(ti+w-1).(tj)     tx.y1.(ti+w-1).(tj);      glVertex2i  vx1 vy1; (* Top Right Of The Texture and Quad *)
-    glTexCoord2f tx.x1.(ti).(tj)         tx.y1.(ti).(tj);          glVertex2i  vx  vy1  (* Top Left Of The Texture and Quad *)
+    Batch.quad tx.x1.(ti).(tj) tx.y1.(ti).(tj) tx.x2.(ti+w-1).(tj) tx.y2.(ti).(tj+h-1) vx vy vx1 vy1
 end
 
 module Grid = struct
@@ -275,7 +371,11 @@ let init_gl width height =
 	
   glBlendFunc gl_src_alpha gl_one_minus_src_alpha; (* Set The Blending Function For Translucency *)
   glEnable gl_blend;
-  glDisable gl_color_material
+  glDisable gl_color_material;
+  (* quads are drawn from the vertex arrays of Batch *)
+  glEnableClientState gl_vertex_array;
+  glEnableClientState gl_texture_coord_array;
+  glEnableClientState gl_color_array
   (* glColor4f 1.0 0.2 0.6 0.5;  *) 
   (*glLineWidth 2.0 *)
 
@@ -0,0 +1,97 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(* Headless driver: runs the simulation without SDL or OpenGL.
+   The player is kept idle, so the world evolves on its own. *)
+
+open Printf
+
+let usage () =
+  eprintf "usage: %s <seed> [duration (s)] [dt (s)] [all]\n" Sys.argv.(0);
+  eprintf "       %s replay <log> [checkpoint interval (Sim.run calls)]\n" Sys.argv.(0);
+  eprintf "  all: simulate every neighboring region on each step\n%!";
+  exit 2
+
+(* answer whatever the game is waiting for, so that it never blocks *)
+let auto_respond s =
+  match s.State.cm with
+  | State.CtrlM.Normal | State.CtrlM.Died _ -> s
+  | State.CtrlM.WaitInput _ -> State.respond s State.Msg.Wait
+  | _ -> State.respond s State.Msg.Cancel
+
+(* run until the clock reaches [duration] or the player dies,
+   returns the final state and the number of Sim.run calls *)
+let simulate duration dt s =
+  let rec loop steps s =
+    let s = auto_respond s in
+    match s.State.cm with
+    | State.CtrlM.Died _ -> (s, steps)
+    | _ when State.Clock.get s.State.clock >= duration -> (s, steps)
+    | _ -> loop (steps + 1) (Sim.run dt s)
+  in
+  loop 0 s
+
+(* replay a recorded session, print the state digests on the way *)
+let replay log every =
+  let t0 = Unix.gettimeofday () in
+  match Replay.play log every with
+  | s, ticks, diverged ->
+      let wall_time = Unix.gettimeofday () -. t0 in
+      printf "ticks\t%i\n" ticks;
+      printf "sim_seconds\t%.3f\n" (State.Clock.get s.State.clock);
+      printf "wall_seconds\t%.3f\n" wall_time;
+      printf "digest\t%s\n" (Replay.state_digest s);
+      ( match diverged with
+        | Some n -> printf "diverged\t%i\n%!" n; exit 1
+        | None -> printf "diverged\tnone\n%!" )
+  | exception Replay.Bad_log what ->
+      eprintf "bad replay log: %s\n%!" what;
+      exit 2
+
+let main () =
+  let argc = Array.length Sys.argv in
+  if argc < 2 then usage ();
+  if Sys.argv.(1) = "replay" then
+  ( if argc < 3 then usage ();
+    replay Sys.argv.(2) (if argc > 3 then int_of_string Sys.argv.(3) else 1000);
+    exit 0 );
+  let seed = Sys.argv.(1) in
+  let duration = if argc > 2 then float_of_string Sys.argv.(2) else 600.0 in
+  let dt = if argc > 3 then float_of_string Sys.argv.(3) else 0.025 in
+  let all_neighbours = argc > 4 && Sys.argv.(4) = "all" in
+  if duration <= 0.0 || dt <= 0.0 then usage ();
+
+  let t0 = Unix.gettimeofday () in
+  let s = State.init seed false in
+  let s = {s with State.opts = {s.State.opts with State.Options.all_neighbours = all_neighbours}} in
+  let t1 = Unix.gettimeofday () in
+  let s, steps = simulate duration dt s in
+  let t2 = Unix.gettimeofday () in
+
+  let sim_time = State.Clock.get s.State.clock in
+  let wall_time = t2 -. t1 in
+  printf "seed\t%s\n" seed;
+  printf "init_wall\t%.3f\n" (t1 -. t0);
+  printf "steps\t%i\n" steps;
+  printf "sim_seconds\t%.3f\n" sim_time;
+  printf "wall_seconds\t%.3f\n" wall_time;
+  printf "sim_per_wall\t%.3f\n" (if wall_time > 0.0 then sim_time /. wall_time else 0.0);
+  ( match s.State.cm with
+    | State.CtrlM.Died _ -> printf "player\tdied\n"
+    | _ -> printf "player\talive\n" );
+  flush stdout
+
+let _ = main ()
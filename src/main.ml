@@ -29,8 +29,19 @@ open Base
 
 open Printf
 
+let save_dir = "savegame"
+
+let autosave_config = Autosave.config_from_env ()
+let autosave = Autosave.make autosave_config
+
+(* session recorder, see Replay *)
+let recorder = ref None
+
 let finalize s =
-  State.save_to_file s "game.save"
+  Autosave.finish autosave;
+  Replay.close !recorder;
+  recorder := None;
+  Savegame.save s save_dir
 
 let normal_keys_input ctrl k g s =
   State.
@@ -93,7 +104,7 @@ let typing_keys_input ctrl k g s =
 
 let process_key_pressed k = function
     State.Play s ->
-      let g m = State.Play (State.respond s m) in
+      let g m = State.Play (Replay.respond !recorder s m) in
       let ctrl = List.mem KMOD_LCTRL k.modifiers in
       (* let shift = List.mem KMOD_LSHIFT k.modifiers || List.mem KMOD_RSHIFT k.modifiers in *)
       State.
@@ -139,7 +150,7 @@ let rec main_loop mode_state prev_ticks was_dead =
               (* FPS *)
               if s.State.debug then
               ( let fps = 1000.0 /. float (ticks - prev_ticks) in
-                glColor4f 1.0 1.0 1.0 1.0; 
+                View.set_color 1.0 1.0 1.0 1.0; 
                 Grafx.Draw.put_string (sprintf "FPS: %.0f" fps) Grafx.Draw.gr_ui (0,0); )
           | _ -> () );
     );
@@ -147,10 +158,17 @@ let rec main_loop mode_state prev_ticks was_dead =
   | State.Play s ->
       let speed = s.State.opts.State.Options.game_speed in
       let speedup = 1.07 ** float speed in
-      State.Play (Sim.run ( 0.011 *. float (ticks - prev_ticks) *. speedup) s) 
+      State.Play (Replay.run !recorder ( 0.011 *. float (ticks - prev_ticks) *. speedup) s) 
   | ms -> ms
   in
 
+  ( match mode_state' with
+    | State.Play s -> 
+        Autosave.update autosave s;
+        (* use the idle time of the frame to prepare the next regions *)
+        ignore (Sim.prefetch s)
+    | _ -> () );
+
   delay(5);
 
   if mode_state' <> State.Exit then
@@ -241,13 +259,20 @@ let main () =
         State.init_full opt_seed false
       )
       else
-      ( if Sys.file_exists "game.save" then 
-          State.load_from_file "game.save"
-        else
-          State.init_full None false
+      ( match Autosave.recover autosave_config save_dir with
+        | Some s -> s
+        | None ->
+            ( match Savegame.saved_version save_dir with
+              | Some v when v <> Savegame.version ->
+                  (* do not overwrite it with a new game *)
+                  eprintf "The save in '%s' has format version %i, this version of the game reads %i.\n" save_dir v Savegame.version;
+                  eprintf "Move it away to start a new game.\n%!";
+                  exit 1
+              | _ -> State.init_full None false )
       )
     in
 
+    recorder := Replay.from_env s;
     State.Play s
   in
 
@@ -0,0 +1,272 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(*
+  A* pathfinding on the walkability mask of a region (4-connected grid).
+
+  Paths are cached per region, keyed by the source and the target cells.
+  
+  Flow fields: the distance to a target (a cell or a zone) from every cell
+  of a region. One field serves all units going to the same target, each
+  of them just follows the decreasing distance.
+  
+  The caches of a region are dropped when its tile grid is replaced or its
+  version changes (a door is opened or closed).
+*)
+
+open Base
+open Common
+
+(* scratch space of the search, reused and grown as needed *)
+let size = ref 0
+let gcost = ref [||]
+let parent = ref [||]
+let seen = ref [||]      (* id of the search that reached the node *)
+let closed = ref [||]    (* id of the search that closed the node *)
+let search_id = ref 0
+
+(* binary heap of nodes by the estimated cost, duplicates are skipped when closed *)
+let hkey = ref [||]
+let hval = ref [||]
+let hlen = ref 0
+
+let ensure n =
+  if n > !size then
+  ( size := n;
+    gcost := Array.make n 0;
+    parent := Array.make n (-1);
+    seen := Array.make n 0;
+    closed := Array.make n 0;
+    hkey := Array.make (4*n + 1) 0;
+    hval := Array.make (4*n + 1) 0 )
+
+let push key v =
+  let hk = !hkey and hv = !hval in
+  let rec up k =
+    if k > 0 then
+    ( let p = (k-1) / 2 in
+      if hk.(p) > key then
+      ( hk.(k) <- hk.(p); hv.(k) <- hv.(p); up p )
+      else
+      ( hk.(k) <- key; hv.(k) <- v ) )
+    else
+    ( hk.(k) <- key; hv.(k) <- v )
+  in
+  up !hlen;
+  incr hlen
+
+let pop () =
+  let hk = !hkey and hv = !hval in
+  let top = hv.(0) in
+  decr hlen;
+  let n = !hlen in
+  let key = hk.(n) and v = hv.(n) in
+  let rec down k =
+    let l = 2*k + 1 in
+    if l < n then
+    ( let c = if l+1 < n && hk.(l+1) < hk.(l) then l+1 else l in
+      if hk.(c) < key then
+      ( hk.(k) <- hk.(c); hv.(k) <- hv.(c); down c )
+      else
+      ( hk.(k) <- key; hv.(k) <- v ) )
+    else
+    ( hk.(k) <- key; hv.(k) <- v )
+  in
+  if n > 0 then down 0;
+  top
+
+(* Shortest path from src to goal (both within the grid), without src.
+   If goal cannot be reached, the path leads to the reachable cell closest to it *)
+let astar a src goal =
+  let w = Tiles.w a and h = Tiles.h a in
+  ensure (w*h);
+  incr search_id;
+  let id = !search_id in
+  let gc = !gcost and par = !parent and seen = !seen and closed = !closed in
+  let (gi, gj) = goal in
+  let heur k = abs (k / h - gi) + abs (k mod h - gj) in
+  let s = fst src * h + snd src in
+  let g = gi * h + gj in
+  hlen := 0;
+  gc.(s) <- 0;
+  par.(s) <- -1;
+  seen.(s) <- id;
+  push (heur s) s;
+  let best = ref s in
+  let relax k ni nj =
+    if ni >= 0 && ni < w && nj >= 0 && nj < h then
+    ( let nk = ni*h + nj in
+      if closed.(nk) <> id && Tiles.can_walk a (ni,nj) then
+      ( let c = gc.(k) + 1 in
+        if seen.(nk) <> id || c < gc.(nk) then
+        ( seen.(nk) <- id;
+          gc.(nk) <- c;
+          par.(nk) <- k;
+          push (c + heur nk) nk ) ) )
+  in
+  let rec loop () =
+    if !hlen > 0 then
+    ( let k = pop () in
+      if closed.(k) <> id then
+      ( closed.(k) <- id;
+        if heur k < heur !best then best := k;
+        if k <> g then
+        ( let i = k / h and j = k mod h in
+          relax k (i+1) j;
+          relax k (i-1) j;
+          relax k i (j+1);
+          relax k i (j-1);
+          loop () ) )
+      else
+        loop () )
+  in
+  loop ();
+  let last = if closed.(g) = id then g else !best in
+  let rec build k acc = if k = s then acc else build par.(k) ((k / h, k mod h) :: acc) in
+  build last []
+
+type target = Cell of loc | Zone of R.Zone.label
+
+(* distances by cell index i*h + j, unreachable cells have max_int *)
+type field = int array
+
+(* paths and fields of a region, valid for one version of its tiles *)
+type region_cache = 
+  { tiles: Tiles.t; 
+    version: int; 
+    paths: (loc * loc, path) Hashtbl.t;
+    fields: (target, field) Hashtbl.t;
+  }
+
+let max_regions = 16
+let max_paths = 1024
+let max_fields = 32
+
+let cache : (region_id, region_cache) Hashtbl.t = Hashtbl.create max_regions
+
+let cache_of rid a =
+  let fresh () =
+    if Hashtbl.length cache >= max_regions then Hashtbl.reset cache;
+    let rc = {tiles = a; version = a.Tiles.version; paths = Hashtbl.create 64; fields = Hashtbl.create 8} in
+    Hashtbl.replace cache rid rc;
+    rc
+  in
+  match Hashtbl.find cache rid with
+  | rc when rc.tiles == a && rc.version = a.Tiles.version -> rc
+  | _ -> fresh ()
+  | exception Not_found -> fresh ()
+
+let clamp a (i,j) = (max 0 (min (Tiles.w a - 1) i), max 0 (min (Tiles.h a - 1) j))
+
+(* Path for the unit u to the location dst, replaces Unit.make_path_to.
+   dst may be just outside the region (next to its edge), then the path leaves the region *)
+let path_to reg u dst =
+  let a = reg.R.a in
+  let src = u.Unit.loc in
+  if src = dst || not (Tiles.is_within a src) then
+    []
+  else
+  ( let paths = (cache_of reg.R.rid a).paths in
+    try Hashtbl.find paths (src, dst) with Not_found ->
+      let inner = clamp a dst in
+      let p = astar a src inner in
+      let reached = match List.rev p with l :: _ -> l | [] -> src in
+      let p =
+        if inner <> dst && reached = inner && loc_manhattan (dst -- inner) = 1 then p @ [dst] else p in
+      if Hashtbl.length paths >= max_paths then Hashtbl.reset paths;
+      Hashtbl.replace paths (src, dst) p;
+      p
+  )
+
+(* breadth-first search from the cells of the target *)
+let compute_field reg target =
+  let a = reg.R.a in
+  let w = Tiles.w a and h = Tiles.h a in
+  let dist = Array.make (w*h) max_int in
+  let queue = Array.make (w*h) 0 in
+  let qlen = ref 0 in
+  let add k d = dist.(k) <- d; queue.(!qlen) <- k; incr qlen in
+  ( match target with
+    | Cell ((i,j) as loc) -> if Tiles.is_within a loc then add (i*h + j) 0
+    | Zone z ->
+        (* the walkable cells of each row, a word of the mask at a time *)
+        for j = 0 to h-1 do
+          for k = 0 to a.Tiles.nw - 1 do
+            let word = ref (Tiles.walk_word a j k) and i = ref (k * Tiles.bits) in
+            while !word <> 0 do
+              if !word land 1 = 1 && R.zone_check reg (!i,j) z then add (!i*h + j) 0;
+              word := !word lsr 1;
+              incr i
+            done
+          done
+        done );
+  let visit d ni nj =
+    if ni >= 0 && ni < w && nj >= 0 && nj < h then
+    ( let nk = ni*h + nj in
+      if dist.(nk) = max_int && Tiles.can_walk a (ni,nj) then add nk (d+1) )
+  in
+  let q = ref 0 in
+  while !q < !qlen do
+    let k = queue.(!q) in
+    let i = k / h and j = k mod h in
+    let d = dist.(k) in
+    visit d (i+1) j;
+    visit d (i-1) j;
+    visit d i (j+1);
+    visit d i (j-1);
+    incr q
+  done;
+  dist
+
+let field reg target =
+  let rc = cache_of reg.R.rid reg.R.a in
+  try Hashtbl.find rc.fields target with Not_found ->
+    let f = compute_field reg target in
+    if Hashtbl.length rc.fields >= max_fields then Hashtbl.reset rc.fields;
+    Hashtbl.replace rc.fields target f;
+    f
+
+(* follow the field from loc down to the target, [] if the target is unreachable *)
+let follow a f loc =
+  let h = Tiles.h a in
+  let d_at (i,j) = if Tiles.is_within a (i,j) then f.(i*h + j) else max_int in
+  let rec next loc d acc =
+    if d = 0 then List.rev acc else
+    ( let best = List.fold_left (fun ((_, bd) as best) dl ->
+          let l = loc ++ dl in
+          let dl = d_at l in
+          if dl < bd then (l, dl) else best
+        ) (loc, d) [(1,0); (-1,0); (0,1); (0,-1)] in
+      match best with
+      | (l, dl) when dl < d -> next l dl (l :: acc)
+      | _ -> List.rev acc )
+  in
+  if Tiles.is_within a loc then next loc (d_at loc) [] else []
+
+(* Path of the unit u to the cell dst along the shared field of dst.
+   Falls back to path_to when dst is outside the region or unreachable *)
+let flow_path_to reg u dst =
+  let a = reg.R.a in
+  if Tiles.is_within a dst && Tiles.is_within a u.Unit.loc then
+    match follow a (field reg (Cell dst)) u.Unit.loc with
+    | [] -> path_to reg u dst
+    | p -> p
+  else
+    path_to reg u dst
+
+(* path of the unit u to the closest cell of the zone *)
+let flow_path_to_zone reg u z =
+  follow reg.R.a (field reg (Zone z)) u.Unit.loc
@@ -0,0 +1,208 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(*
+  Recording and replaying sessions.
+
+  A log contains everything that changes the state from outside: the dt of
+  every Sim.run call and every message passed to State.respond. The initial
+  state is saved next to the log (Savegame directory log.start), so a session
+  continued from a save can be recorded too. All random numbers of the
+  simulation come from streams derived from the world seed and the step
+  number, so running the log again reproduces the session exactly.
+
+  Log lines (after the magic and the version):
+    seed S          random seed of the world, for information
+    d X             Sim.run, X are the bits of dt in hex
+    m MSG           State.respond
+    c N DIGEST      checkpoint: digest of the state after the N-th Sim.run
+
+  Configuration (environment):
+    WANDERERS_REPLAY        file to record the session to
+    WANDERERS_REPLAY_CHECK  Sim.run calls between the checkpoints (0 - none)
+*)
+
+open Printf
+
+let magic = "WANDERERS-REPLAY"
+let version = 2
+
+exception Bad_log of string
+
+let start_dir log = log ^ ".start"
+
+module M = State.Msg
+
+let string_of_msg = function
+  | M.Left -> "Left"
+  | M.Right -> "Right"
+  | M.Up -> "Up"
+  | M.Down -> "Down"
+  | M.Wait -> "Wait"
+  | M.Attack i -> sprintf "Attack %i" i
+  | M.Rest -> "Rest"
+  | M.Assign -> "Assign"
+  | M.OpenInventory -> "OpenInventory"
+  | M.Cancel -> "Cancel"
+  | M.Confirm -> "Confirm"
+  | M.Num i -> sprintf "Num %i" i
+  | M.Fire -> "Fire"
+  | M.Look -> "Look"
+  | M.UpStairs -> "UpStairs"
+  | M.DownStairs -> "DownStairs"
+  | M.Atlas -> "Atlas"
+  | M.Console -> "Console"
+  | M.ScrollForward -> "ScrollForward"
+  | M.ScrollBackward -> "ScrollBackward"
+  | M.OptsSpeedup -> "OptsSpeedup"
+  | M.OptsSlowdown -> "OptsSlowdown"
+  | M.Char c -> sprintf "Char %i" (Char.code c)
+  | M.Backspace -> "Backspace"
+  | M.Delete -> "Delete"
+
+let msg_of_string str =
+  let word, arg =
+    try
+      let i = String.index str ' ' in
+      (String.sub str 0 i, Some (int_of_string (String.sub str (i+1) (String.length str - i - 1))))
+    with
+      Not_found -> (str, None)
+    | Failure _ -> raise (Bad_log str)
+  in
+  match word, arg with
+  | "Left", None -> M.Left
+  | "Right", None -> M.Right
+  | "Up", None -> M.Up
+  | "Down", None -> M.Down
+  | "Wait", None -> M.Wait
+  | "Attack", Some i -> M.Attack i
+  | "Rest", None -> M.Rest
+  | "Assign", None -> M.Assign
+  | "OpenInventory", None -> M.OpenInventory
+  | "Cancel", None -> M.Cancel
+  | "Confirm", None -> M.Confirm
+  | "Num", Some i -> M.Num i
+  | "Fire", None -> M.Fire
+  | "Look", None -> M.Look
+  | "UpStairs", None -> M.UpStairs
+  | "DownStairs", None -> M.DownStairs
+  | "Atlas", None -> M.Atlas
+  | "Console", None -> M.Console
+  | "ScrollForward", None -> M.ScrollForward
+  | "ScrollBackward", None -> M.ScrollBackward
+  | "OptsSpeedup", None -> M.OptsSpeedup
+  | "OptsSlowdown", None -> M.OptsSlowdown
+  | "Char", Some i when i >= 0 && i < 256 -> M.Char (Char.chr i)
+  | "Backspace", None -> M.Backspace
+  | "Delete", None -> M.Delete
+  | _ -> raise (Bad_log str)
+
+(* Digest of the whole state. Without sharing, it depends only on the values.
+   The regions in Prio are taken as a list, since the shape of the map depends on
+   the order they were added in (it is different after loading) *)
+let state_digest s =
+  let geo = s.State.geo in
+  let prio = geo.Global.G.prio in
+  let s' = {s with State.geo = {geo with Global.G.prio = {prio with Global.Prio.ml = Global.Prio.Ml.empty}}} in
+  let v = (s', Global.Prio.Ml.bindings prio.Global.Prio.ml) in
+  Digest.to_hex (Digest.string (Marshal.to_string v [Marshal.No_sharing]))
+
+type recorder = {oc: out_channel; check: int; mutable ticks: int}
+
+(* inputs during the current step, each one gets a random stream of its own *)
+let inputs = ref (-1, 0)
+
+let start log check s =
+  Savegame.save s (start_dir log);
+  inputs := (-1, 0);
+  let oc = open_out log in
+  fprintf oc "%s\n%i\nseed %s\n%!" magic version s.State.random_seed;
+  {oc; check; ticks = 0}
+
+(* start recording if asked in the environment *)
+let from_env s =
+  match Sys.getenv "WANDERERS_REPLAY" with
+  | log ->
+      let check = try int_of_string (Sys.getenv "WANDERERS_REPLAY_CHECK") with Not_found | Failure _ -> 0 in
+      Some (start log check s)
+  | exception Not_found -> None
+
+let close = function
+  | Some r -> close_out r.oc
+  | None -> ()
+
+(* State.respond, with a random stream of its own *)
+let respond rec_opt s msg =
+  ( match rec_opt with
+    | Some r -> fprintf r.oc "m %s\n%!" (string_of_msg msg)
+    | None -> () );
+  let step = s.State.step in
+  let n = match !inputs with (st, n) when st = step -> n + 1 | _ -> 0 in
+  inputs := (step, n);
+  let rng = Base.Rng.derive [|s.State.world_seed; step; State.rng_key_input; n|] in
+  Base.Rng.use rng (fun () -> State.respond s msg)
+
+(* Sim.run *)
+let run rec_opt dt s =
+  match rec_opt with
+  | Some r ->
+      fprintf r.oc "d %016Lx\n%!" (Int64.bits_of_float dt);
+      let s = Sim.run dt s in
+      r.ticks <- r.ticks + 1;
+      if r.check > 0 && r.ticks mod r.check = 0 then
+        fprintf r.oc "c %i %s\n%!" r.ticks (state_digest s);
+      s
+  | None -> Sim.run dt s
+
+(* Replay the log as fast as possible. The digest of the state is printed every [every]
+   Sim.run calls (if every > 0), the checkpoints of the log are verified.
+   Returns the final state, the number of Sim.run calls and the first diverged checkpoint *)
+let play log every =
+  let s0 =
+    match Savegame.load (start_dir log) with
+    | Some s -> s
+    | None -> raise (Bad_log (start_dir log)) in
+  let ic = open_in log in
+  let close_and x = close_in ic; x in
+  ( try
+      if input_line ic <> magic || int_of_string (input_line ic) <> version then raise (Bad_log log)
+    with End_of_file | Failure _ -> close_in ic; raise (Bad_log log) );
+  inputs := (-1, 0);
+  let rec loop ticks s =
+    match input_line ic with
+    | exception End_of_file -> close_and (s, ticks, None)
+    | line when String.length line > 2 ->
+        let arg = String.sub line 2 (String.length line - 2) in
+        ( match line.[0] with
+          | 'd' ->
+              let dt = Int64.float_of_bits (Int64.of_string ("0x" ^ arg)) in
+              let s = Sim.run dt s in
+              let ticks = ticks + 1 in
+              if every > 0 && ticks mod every = 0 then
+                printf "%i\t%s\n%!" ticks (state_digest s);
+              loop ticks s
+          | 'm' -> loop ticks (respond None s (msg_of_string arg))
+          | 'c' ->
+              let n, d = Scanf.sscanf arg "%i %s" (fun n d -> (n, d)) in
+              if n = ticks && state_digest s <> d then
+                close_and (s, ticks, Some n)
+              else
+                loop ticks s
+          | 's' -> loop ticks s
+          | _ -> close_in ic; raise (Bad_log line) )
+    | line -> close_in ic; raise (Bad_log line)
+  in
+  loop 0 s0
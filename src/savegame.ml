@@ -0,0 +1,308 @@
+(*           Wanderers - open world adventure game.
+            Copyright (C) 2013-2014  Alexey Nikolaev.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
+
+(*
+  Chunked save format.
+
+  A save is a directory. Each part of the state is a separate chunk file:
+    core       - small fields of State.t, the current region id and the Prio rank
+    map        - region locations and neighbors (never change)
+    rm         - regions' meta info
+    region.N   - region N from Prio
+    actors     - Org.Astr
+    pol        - politics
+    atlas      - player's map memory
+
+  The text file "header" is written last. It contains the format version
+  and the digest of every chunk, so it commits the save: an interrupted
+  save leaves the previous header (and the chunks it refers to) valid.
+  A chunk is rewritten only if its digest differs from the one in the header.
+  A region that has not changed since it was saved is not even marshalled.
+*)
+
+open Base
+open Common
+open Global
+
+let magic = "WANDERERS-SAVE"
+(* increase when the type of any saved value changes *)
+let version = 12
+
+exception Invalid of string
+
+(* fields of State.t that are not saved in their own chunks *)
+type core =
+  { target_cursor : loc;
+    look_cursor : loc;
+    cm : State.CtrlM.t;
+    controller_id : int;
+    rem_dt : float;
+    top_rem_dt : float;
+    vision : int Area.t;
+    clock : State.Clock.t;
+    clock_last_alive_check : State.Clock.t;
+    opts : State.Options.t;
+    debug : bool;
+    random_seed : string;
+    world_seed : int;
+    step : int;
+    next_unit_id : int;
+    console : Console.t;
+    currid : region_id;
+    rank : region_id list;
+  }
+
+let region_chunk rid = "region." ^ string_of_int rid
+
+let chunk_file dir name = Filename.concat dir name
+let header_file dir = Filename.concat dir "header"
+
+let exists dir = Sys.file_exists (header_file dir)
+
+let write_file file data =
+  let tmp = file ^ ".tmp" in
+  let oc = open_out_bin tmp in
+  output_string oc data;
+  close_out oc;
+  Sys.rename tmp file
+
+let read_file file =
+  let ic = open_in_bin file in
+  let len = in_channel_length ic in
+  let data = really_input_string ic len in
+  close_in ic;
+  data
+
+(* header: magic, version, then "name digest" per line.
+   Returns the list of (name, digest) or None if the save is absent or of another version *)
+let read_header dir =
+  try
+    let ic = open_in (header_file dir) in
+    let rec read_chunks acc =
+      match (try Some (input_line ic) with End_of_file -> None) with
+      | Some line -> read_chunks (Scanf.sscanf line "%s %s" (fun name digest -> (name, digest)) :: acc)
+      | None -> List.rev acc
+    in
+    let result =
+      try
+        let m = input_line ic in
+        let v = int_of_string (input_line ic) in
+        if m = magic && v = version then Some (read_chunks []) else None
+      with
+        End_of_file | Failure _ | Scanf.Scan_failure _ -> None
+    in
+    close_in ic;
+    result
+  with
+    Sys_error _ -> None
+
+(* format version of the save in dir, None if there is no save *)
+let saved_version dir =
+  try
+    let ic = open_in (header_file dir) in
+    let v = 
+      try if input_line ic = magic then Some (int_of_string (input_line ic)) else None
+      with End_of_file | Failure _ -> None in
+    close_in ic;
+    v
+  with
+    Sys_error _ -> None
+
+let write_header dir manifest =
+  let buf = Buffer.create 512 in
+  Buffer.add_string buf (Printf.sprintf "%s\n%i\n" magic version);
+  List.iter (fun (name, digest) -> Buffer.add_string buf (Printf.sprintf "%s %s\n" name digest)) manifest;
+  write_file (header_file dir) (Buffer.contents buf)
+
+let digest data = Digest.to_hex (Digest.string data)
+
+(* digests of the chunks that never change, by value (physically) *)
+let static_digests : (string, Obj.t * string) Hashtbl.t = Hashtbl.create 8
+
+(* write the chunk if it differs from the saved one, return (name, digest) *)
+let save_chunk dir old name v =
+  let file = chunk_file dir name in
+  let up_to_date d = List.mem (name, d) old && Sys.file_exists file in
+  let data = Marshal.to_string v [] in
+  let d = digest data in
+  if not (up_to_date d) then write_file file data;
+  (name, d)
+
+(* the same for a value that is never modified: it is not even marshalled
+   if it has been saved before *)
+let save_static_chunk dir old name v =
+  let file = chunk_file dir name in
+  try
+    let (v', d) = Hashtbl.find static_digests file in
+    if v' == Obj.repr v && List.mem (name, d) old && Sys.file_exists file then
+      (name, d)
+    else
+      raise Not_found
+  with Not_found ->
+    let (_, d) as result = save_chunk dir old name v in
+    Hashtbl.replace static_digests file (Obj.repr v, d);
+    result
+
+(* Regions are mostly left alone between the saves (only the simulated ones change),
+   so a region is not marshalled again if it is physically the one saved to the file 
+   and it has not been touched (changed in place, see Sim.run) since *)
+let stamps : (region_id, int) Hashtbl.t = Hashtbl.create 64
+let region_saves : (string, Obj.t * int * string) Hashtbl.t = Hashtbl.create 64
+
+let stamp rid = try Hashtbl.find stamps rid with Not_found -> 0
+
+(* the region is changed in place *)
+let touch rid = Hashtbl.replace stamps rid (stamp rid + 1)
+
+let save_region_chunk dir old rid reg =
+  let name = region_chunk rid in
+  let file = chunk_file dir name in
+  let save () =
+    let (_, d) as result = save_chunk dir old name reg in
+    Hashtbl.replace region_saves file (Obj.repr reg, stamp rid, d);
+    result
+  in
+  match Hashtbl.find region_saves file with
+  | (v, st, d) when v == Obj.repr reg && st = stamp rid && List.mem (name, d) old && Sys.file_exists file -> (name, d)
+  | _ -> save ()
+  | exception Not_found -> save ()
+
+let save s dir =
+  if not (Sys.file_exists dir) then Unix.mkdir dir 0o755;
+  let old = match read_header dir with Some ls -> ls | None -> [] in
+  let geo = s.State.geo in
+  (* the player changes the current region in place *)
+  touch geo.G.currid;
+  let core =
+    { target_cursor = s.State.target_cursor;
+      look_cursor = s.State.look_cursor;
+      cm = s.State.cm;
+      controller_id = s.State.controller_id;
+      rem_dt = s.State.rem_dt;
+      top_rem_dt = s.State.top_rem_dt;
+      vision = s.State.vision;
+      clock = s.State.clock;
+      clock_last_alive_check = s.State.clock_last_alive_check;
+      opts = s.State.opts;
+      debug = s.State.debug;
+      random_seed = s.State.random_seed;
+      world_seed = s.State.world_seed;
+      step = s.State.step;
+      next_unit_id = s.State.next_unit_id;
+      console = s.State.console;
+      currid = geo.G.currid;
+      rank = geo.G.prio.Prio.rank;
+    }
+  in
+  let regions =
+    Prio.Ml.fold (fun rid reg acc -> save_region_chunk dir old rid reg :: acc) geo.G.prio.Prio.ml [] in
+  let manifest =
+    [ save_chunk dir old "core" core;
+      save_static_chunk dir old "map" (geo.G.loc, geo.G.nb);
+      save_chunk dir old "rm" geo.G.rm;
+      save_chunk dir old "actors" s.State.astr;
+      save_static_chunk dir old "pol" s.State.pol;
+      save_chunk dir old "atlas" s.State.atlas;
+    ] @ List.rev regions
+  in
+  write_header dir manifest;
+  (* remove the chunks that are not in the save anymore *)
+  List.iter (fun (name, _) ->
+    if not (List.mem_assoc name manifest) then
+    ( Hashtbl.remove region_saves (chunk_file dir name);
+      (try Sys.remove (chunk_file dir name) with Sys_error _ -> ()) )
+  ) old
+
+let read_chunk dir manifest name =
+  let expected = try List.assoc name manifest with Not_found -> raise (Invalid name) in
+  let data = try read_file (chunk_file dir name) with Sys_error _ | End_of_file -> raise (Invalid name) in
+  if digest data <> expected then raise (Invalid name);
+  Marshal.from_string data 0
+
+(* Load everything except the regions other than the current one.
+   Returns the state and the ids of the regions still to be loaded *)
+let load_partial dir =
+  match read_header dir with
+  | None -> None
+  | Some manifest ->
+      try
+        let get name = read_chunk dir manifest name in
+        let (core : core) = get "core" in
+        let ((loc, nb) : region_loc array * (region_id G.Me.t) array) = get "map" in
+        let (rm : RM.t array) = get "rm" in
+        let (reg : R.t) = get (region_chunk core.currid) in
+        let (astr : Org.Astr.t) = get "actors" in
+        let (pol : Pol.t) = get "pol" in
+        let (atlas : Atlas.t) = get "atlas" in
+        let prio = {Prio.ml = Prio.Ml.add core.currid reg Prio.Ml.empty; Prio.rank = core.rank} in
+        let geo = {G.currid = core.currid; G.loc = loc; G.rm = rm; G.nb = nb; G.prio = prio} in
+        let s =
+          { State.target_cursor = core.target_cursor;
+            State.look_cursor = core.look_cursor;
+            State.cm = core.cm;
+            State.geo = geo;
+            State.controller_id = core.controller_id;
+            State.rem_dt = core.rem_dt;
+            State.top_rem_dt = core.top_rem_dt;
+            State.pol = pol;
+            State.astr = astr;
+            State.vision = core.vision;
+            State.atlas = atlas;
+            State.clock = core.clock;
+            State.clock_last_alive_check = core.clock_last_alive_check;
+            State.opts = core.opts;
+            State.debug = core.debug;
+            State.random_seed = core.random_seed;
+            State.world_seed = core.world_seed;
+            State.step = core.step;
+            State.next_unit_id = core.next_unit_id;
+            State.console = core.console;
+          }
+        in
+        let rest = List.filter (fun rid -> rid <> core.currid && List.mem_assoc (region_chunk rid) manifest) core.rank in
+        Some (s, rest)
+      with
+        Invalid _ -> None
+
+(* Load the given regions into Prio. A region that cannot be read is left out of
+   Prio (it is generated again when needed), its allocated movables go back to latent *)
+let load_regions dir rids s =
+  match read_header dir with
+  | None -> s
+  | Some manifest ->
+      let geo = s.State.geo in
+      let ml, lost =
+        List.fold_left (fun (ml, lost) rid ->
+          try
+            let (reg : R.t) = read_chunk dir manifest (region_chunk rid) in
+            (Prio.Ml.add rid reg ml, lost)
+          with Invalid name ->
+            Printf.eprintf "Savegame: chunk %s is invalid, the region is dropped\n%!" name;
+            let rm = geo.G.rm.(rid) in
+            geo.G.rm.(rid) <- {rm with RM.lat = Mov.add rm.RM.alloc rm.RM.lat; RM.alloc = Mov.zero()};
+            (ml, rid :: lost)
+        ) (geo.G.prio.Prio.ml, []) rids
+      in
+      let rank = List.filter (fun rid -> not (List.mem rid lost)) geo.G.prio.Prio.rank in
+      {s with State.geo = {geo with G.prio = {Prio.ml = ml; Prio.rank = rank}}}
+
+let load dir =
+  match load_partial dir with
+  | Some (s, rest) ->
+      Printf.printf "Random seed: %s\n%!" s.State.random_seed;
+      Unit.next_id := s.State.next_unit_id;
+      Some (load_regions dir rest s)
+  | None -> None
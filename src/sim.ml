@@ -21,9 +21,9 @@ open Global
 
 let comp_transfer area (i,j) = 
   if i < 0 then Some West else
-  if i >= Area.w area then Some East else
+  if i >= Tiles.w area then Some East else
   if j < 0 then Some South else
-  if j >= Area.h area then Some North else None
+  if j >= Tiles.h area then Some North else None
 
 (* check location *)
 let is_loc_in_prio geo rid a loc =
@@ -45,23 +45,23 @@ let is_loc_in_prio geo rid a loc =
 let make_long_random_path geo reg u =
   let a = reg.R.a in
   let rec path l dl n =
-    let is_within = Area.is_within a l in
+    let is_within = Tiles.is_within a l in
     if n > 0 && 
           ( not is_within && is_loc_in_prio geo reg.R.rid a l
-            || is_within && Tile.classify (Area.get a l) = Tile.CFloor ) then 
+            || is_within && Tiles.classify a l = Tile.CFloor ) then 
       l :: path (l++dl) dl (n-1) 
     else [] in
   match Random.int 2 with
   | 0 -> 
       let x0,_ = u.Unit.loc in
-      let x1 = Random.int (Area.w a + 2) - 1 in
+      let x1 = Random.int (Tiles.w a + 2) - 1 in
       let dx = x1-x0 in
       if dx > 0 then path (u.Unit.loc ++ (1,0)) (1,0) (abs dx)
       else if dx < 0 then path (u.Unit.loc ++ (-1,0)) (-1,0) (abs dx)
       else []
   | _ -> 
       let _,y0 = u.Unit.loc in
-      let y1 = Random.int (Area.h a + 2) - 1 in
+      let y1 = Random.int (Tiles.h a + 2) - 1 in
       let dy = y1-y0 in
       if dy > 0 then path (u.Unit.loc ++ (0,1)) (0,1) dy
       else if dy < 0 then path (u.Unit.loc ++ (0,-1)) (0,-1) (-dy)
@@ -71,11 +71,11 @@ let make_short_random_path geo reg u =
   let (x0,y0) = u.Unit.loc in
   let dstloc = 
     match Random.int 2 with
-    | 0 -> (Random.int (Area.w reg.R.a + 2) - 1, y0)
-    | _ -> (x0, Random.int (Area.h reg.R.a + 2) - 1)
+    | 0 -> (Random.int (Tiles.w reg.R.a + 2) - 1, y0)
+    | _ -> (x0, Random.int (Tiles.h reg.R.a + 2) - 1)
   in
-  if ((Area.is_within reg.R.a dstloc) || (is_loc_in_prio geo reg.R.rid reg.R.a dstloc)) && (dstloc <> u.Unit.loc) then
-    Unit.make_path_to reg.R.a u dstloc 
+  if ((Tiles.is_within reg.R.a dstloc) || (is_loc_in_prio geo reg.R.rid reg.R.a dstloc)) && (dstloc <> u.Unit.loc) then
+    Pathfind.path_to reg u dstloc 
   else
     make_long_random_path geo reg u
 
@@ -107,34 +107,78 @@ let rec progress_ntfy dt = function
   | (ev, t)::tl when t < 4.0 -> (ev, t+.dt) :: progress_ntfy dt tl
   | _ -> []
 
-let move_dv area ue dt dv u =
+(* Collision forces of all units of the registry, from their positions at the
+   start of the step. Every pair is handled once, the force on each side is the
+   shared kernel times the mass of the other unit. 
+   Two units are a pair if their cells differ by at most the sum of their radii
+   plus one (the positions are up to half a cell away from the cell's center)
+   in both coordinates, so large units touch diagonally and from farther cells *)
+let collide ue =
+  let n = Array.length ue.E.units in
+  let rmax = ref 0.0 in
+  for k = 0 to n-1 do
+    if ue.E.cell.(k) >= 0 then
+    ( ue.E.fx.(k) <- 0.0;
+      ue.E.fy.(k) <- 0.0;
+      if ue.E.radius.(k) > !rmax then rmax := ue.E.radius.(k) )
+  done;
+  let px = ue.E.px and py = ue.E.py and mass = ue.E.mass and radius = ue.E.radius in
+  let fx = ue.E.fx and fy = ue.E.fy in
+  for k = 0 to n-1 do
+    if ue.E.cell.(k) >= 0 then
+    ( let i = ue.E.li.(k) and j = ue.E.lj.(k) in
+      let rk = radius.(k) in
+      let reach = truncate (rk +. !rmax +. 1.0) in
+      let pair k' =
+        if k' > k then
+        ( let r = rk +. radius.(k') in
+          let lim = truncate (r +. 1.0) in
+          if abs (ue.E.li.(k') - i) <= lim && abs (ue.E.lj.(k') - j) <= lim then
+          ( let dx = px.(k) -. px.(k') in
+            let dy = py.(k) -. py.(k') in
+            let cdist2 = dx*.dx +. dy*.dy in
+            let cdist = sqrt cdist2 in
+            let dr = if cdist < r then cdist -. r else 0.0 in
+            let g = (0.20 *. (dr*.dr) +. 0.05 *. exp(-. cdist2 /. (r*.r))) /. (cdist +. 0.01) in
+            let gk = g *. mass.(k') and gk' = g *. mass.(k) in
+            fx.(k) <- fx.(k) +. gk *. dx;
+            fy.(k) <- fy.(k) +. gk *. dy;
+            fx.(k') <- fx.(k') -. gk' *. dx;
+            fy.(k') <- fy.(k') -. gk' *. dy ) )
+      in
+      for ci = i - reach to i + reach do
+        for cj = j - reach to j + reach do
+          E.iter_cell_slots ue ci cj pair
+        done
+      done )
+  done
+
+(* a sleeping unit wakes up when its collision force changes by more than this *)
+let wake_force = 0.5
+
+let wake_on_collisions ue =
+  for k = 0 to Array.length ue.E.units - 1 do
+    if ue.E.cell.(k) >= 0 && ue.E.sleep.(k) > 0.0 then
+    ( let dfx = ue.E.fx.(k) -. ue.E.sfx.(k) and dfy = ue.E.fy.(k) -. ue.E.sfy.(k) in
+      if dfx*.dfx +. dfy*.dfy > wake_force *. wake_force then ue.E.sleep.(k) <- 0.0 )
+  done
+
+(* collision force on u, computed by collide *)
+let collision_force ue u =
+  let k = E.slot_of u.Unit.id ue in
+  if k >= 0 then (ue.E.fx.(k), ue.E.fy.(k)) else (0.0, 0.0)
+
+(* ac is the list of actions of the unit if it moves successfully *)
+let move_dv area ue dt dv ac u =
   let dist = vec_len dv in
   
-  let traction_factor = Tile.get_traction (Area.get area u.Unit.loc) in
-  let friction_factor = Tile.get_friction (Area.get area u.Unit.loc) in
+  let traction_factor = Tiles.get_traction area u.Unit.loc in
+  let friction_factor = Tiles.get_friction area u.Unit.loc in
   
   let force_intention = 
     traction_factor *.
     ((Unit.get_athletic u) *. exp(-3.3*.(dist-.0.5)*.(dist-.0.5))) %%. dv in
-  let force_collision = 
-    List.fold_left (fun accf cu -> 
-      let cdv = u.Unit.pos --. cu.Unit.pos in
-      (* let cdist2 = vec_len2 cdv +. 0.01 in *)
-      let mass = Unit.get_total_mass cu in
-      
-      let radius = (Unit.get_radius u +. Unit.get_radius cu) in
-      let radius2 = radius*.radius in
-      let cdist2 = vec_len2 cdv in
-      let cdist = sqrt cdist2 in
-      let cdist_x = cdist +. 0.01 in
-      let dr = (min 0. (cdist -. radius)) in
-      let ff = (0.20 *. (dr*.dr)  +. 0.05 *. exp(-1.0 /. radius2 *. cdist2)) *. mass %%. (cdv //. (cdist_x)) in
-      (*
-      let ff = (0.20 *. exp(-10.0 *. cdist2) +. 0.05 *. exp(-1.0 *. cdist2)) *. mass %%. (cdv //. (sqrt cdist2)) in
-      *)
-      accf ++. ff
-    ) (0.0,0.0) (E.collisions_nb u ue) in
-  let force = force_intention ++. force_collision in
+  let force = force_intention ++. collision_force ue u in
 
   let vel_len2 = vec_len2 u.Unit.vel in
   let a = (10.0) %%. force //. Unit.get_total_mass u --. friction_factor *. (1.0 +. 1.0*.vel_len2) %%. u.Unit.vel in
@@ -146,7 +190,7 @@ let move_dv area ue dt dv u =
 
   (* pos and vel *)
   if is_walkable area nloc then
-    {u with Unit.vel=nvel; Unit.pos=npos; Unit.ntfy = nntfy;}
+    {u with Unit.vel=nvel; Unit.pos=npos; Unit.ntfy = nntfy; Unit.ac = ac}
   else
   ( (* reaction ? *)
     let transfer = comp_transfer area nloc in
@@ -191,32 +235,30 @@ let move area ue dt u =
             let target = vec_of_loc 
               (match path with hd::_ -> hd | _ -> u.Unit.loc) in
             let dv = target --. u.Unit.pos in
-            let u' = move_dv area ue dt dv u in
             (* advanse walking time *)
-            ( let ac =
-                match u'.Unit.ac with
-                | (Walk (path,w))::tl -> (Walk (path, w+.dt))::tl
-                | (Run (path,w))::tl -> (Run (path, w+.dt))::tl
-                | x -> x in
-              {u' with Unit.ac = ac}
-            )
+            let ac = 
+              match ac_hd with
+              | Walk _ -> (Walk (path, w+.dt))::ac_tl
+              | _ -> (Run (path, w+.dt))::ac_tl in
+            move_dv area ue dt dv ac u
         | Wait (loc,w) ->
             let dv = vec_of_loc loc --. u.Unit.pos in
-            let u' = move_dv area ue dt dv u in
-            {u' with Unit.ac = (Wait (loc,w+.dt))::ac_tl} 
+            let ac = (Wait (loc,w+.dt))::ac_tl in
+            let u' = move_dv area ue dt dv ac u in
+            if u'.Unit.ac == ac then u' else {u' with Unit.ac = ac}
         | Timed (hold_opt, t_passed, t_end, ta) -> 
             (* optional hold ground *)
             let dv = match hold_opt with
                 Some loc -> vec_of_loc loc --. u.Unit.pos
               | _ -> (0.0, 0.0) in 
-            move_dv area ue dt dv u
+            move_dv area ue dt dv u.Unit.ac u
         | OperateObj _ 
         | Lookaround _ 
         | FireProj _  ->
-            move_dv area ue dt (0.0, 0.0) u
+            move_dv area ue dt (0.0, 0.0) u.Unit.ac u
       )
   | [] ->
-    move_dv area ue dt (0.0, 0.0) u
+    move_dv area ue dt (0.0, 0.0) [] u
 
 
 
@@ -338,21 +380,11 @@ let deal_damage dt fnctgt u tu ue =
 
 
 let find_location prop reg u =
-  let ls = 
-    fold_lim (fun acc i ->
-      fold_lim (fun acc j ->
-        if Area.get u.Unit.sight (i,j) > 0 && prop u reg (i,j) then
-          (i,j)::acc
-        else
-          acc
-      ) acc 0 (Area.h reg.R.a - 1)
-    ) [] 0 (Area.w reg.R.a - 1)
-  in
-  any_from_ls ls 
+  any_from_ls (Vision.visible_cells_with (prop u reg) reg u.Unit.loc 8)
 
 let make_path_to_loc_with_property prop reg u =
   match find_location prop reg u with
-  | Some loc when u.Unit.loc <> loc -> Some (Unit.make_path_to reg.R.a u loc)
+  | Some loc when u.Unit.loc <> loc -> Some (Pathfind.path_to reg u loc)
   | _ -> None
 
 (* come up with new actions *)
@@ -392,54 +424,51 @@ let intel geo astr reg pol ue u =
     (* otherwise try to do something smarter *)
     ( match u.Unit.ac with
       | (Lookaround dist) :: tl ->
-          let u' = Vision.update_mob_sight reg dist u in
-          let ls = fold_lim (fun acc i ->
-              fold_lim (fun acc j ->
-                let loc = u.Unit.loc ++ (i,j) in
-                if (i<>0||j<>0) && Area.is_within u'.Unit.sight loc && Area.get u'.Unit.sight loc = 1 then 
-                  f(i,j) :: acc else acc
-              ) acc (-dist) dist
-            ) [] (-dist) dist in
-          ( match any_from_ls (List.concat ls) with
+          let ls = g (Vision.visible_units reg ue u.Unit.loc dist) in
+          ( match any_from_ls ls with
             | Some tu ->
                 (* remember the target *)
-                let u' = Unit.({u' with tactmem = TactMem.(singleton (EnemySeen (u.loc, tu.id, tu.loc)))}) in
+                let u = Unit.({u with tactmem = TactMem.(singleton (EnemySeen (u.loc, tu.id, tu.loc)))}) in
                 ( match Unit.get_ranged u with
                   | Some _ -> (* Ranged attack *)
                       let delaytime = Unit.get_default_ranged_wait u in
-                      {u' with Unit.ac = [ Timed(Some u'.Unit.loc, 0.0, delaytime, Prepare(FireProj (tu.Unit.loc)))] }
+                      {u with Unit.ac = [ Timed(Some u.Unit.loc, 0.0, delaytime, Prepare(FireProj (tu.Unit.loc)))] }
                   | _ -> (* Melee attack *)
-                      {u' with Unit.ac = [Walk (Unit.make_path_to reg.R.a u' tu.Unit.loc, 0.0)]} 
+                      {u with Unit.ac = [Walk (Pathfind.flow_path_to reg u tu.Unit.loc, 0.0)]} 
                 )
             | _ ->
               (* try to recall the enemy's position *)
-              ( match Unit.TactMem.find_enemyseen u'.Unit.tactmem with
+              ( match Unit.TactMem.find_enemyseen u.Unit.tactmem with
                 | None -> 
                   ( let to_wait =
-                      match Unit.get_sp u' with
+                      match Unit.get_sp u with
                         Species.Cow, _ -> 0.9 | Species.Horse, _ -> 0.80 | _ -> -0.1 in
                     
                     let default () =
-                        {u' with Unit.ac = [Walk (make_some_random_path geo reg u', 0.0)]} 
+                        {u with Unit.ac = [Walk (make_some_random_path geo reg u, 0.0)]} 
                     in
                       
                     if Random.float 1.0 < to_wait then
-                      {u' with Unit.ac = [Wait (u'.Unit.loc, 0.0)]} 
+                      {u with Unit.ac = [Wait (u.Unit.loc, 0.0)]} 
                     else
-                    ( match Org.Astr.get_from_unit u' astr with
+                    ( match Org.Astr.get_from_unit u astr with
                       | Some a when Org.Actor.get_wcl a = Org.Actor.WC_Merchant -> 
                           (* Merchant walking *)
-                          if R.zone_check reg (u'.Unit.loc) (R.Zone.Cons RM.CMarket) && Random.float 1.0 < 0.98 then
-                            {u' with Unit.ac = [Wait (u'.Unit.loc, 0.0)]} 
+                          if R.zone_check reg (u.Unit.loc) (R.Zone.Cons RM.CMarket) && Random.float 1.0 < 0.98 then
+                            {u with Unit.ac = [Wait (u.Unit.loc, 0.0)]} 
                           else
                           ( if RM.has_market geo.G.rm.(reg.R.rid) then
                               let path = 
-                                let prop = (fun u r ij -> R.zone_check r ij (R.Zone.Cons RM.CMarket)) in
-                                match make_path_to_loc_with_property prop reg u' with
-                                | Some path -> path 
-                                | None -> make_some_random_path geo reg u'
+                                match Pathfind.flow_path_to_zone reg u (R.Zone.Cons RM.CMarket) with
+                                | [] ->
+                                    (* already there, walk around *)
+                                    let prop = (fun u r ij -> R.zone_check r ij (R.Zone.Cons RM.CMarket)) in
+                                    ( match make_path_to_loc_with_property prop reg u with
+                                      | Some path -> path 
+                                      | None -> make_some_random_path geo reg u )
+                                | path -> path
                               in
-                              {u' with Unit.ac = [Walk (path, 0.0)]} 
+                              {u with Unit.ac = [Walk (path, 0.0)]} 
                             else
                               default()
                           )
@@ -450,14 +479,14 @@ let intel geo astr reg pol ue u =
                 | Some (ownloc, tid, tloc) ->
                   (* attack the enemy there *)
                   ( 
-                    if u'.Unit.loc <> tloc then
-                    ( let path = Unit.make_path_to reg.R.a u' tloc in
+                    if u.Unit.loc <> tloc then
+                    ( let path = Pathfind.flow_path_to reg u tloc in
                       match path with
                         [] ->
-                          { u' with Unit.ac = [Walk (make_some_random_path geo reg u', 0.0)];
+                          { u with Unit.ac = [Walk (make_some_random_path geo reg u, 0.0)];
                             Unit.tactmem = Unit.TactMem.empty;
                           }
-                      | _ -> {u' with Unit.ac = [Walk (path, 0.0)]} 
+                      | _ -> {u with Unit.ac = [Walk (path, 0.0)]} 
                     )
                     else
                     ( 
@@ -477,9 +506,9 @@ let intel geo astr reg pol ue u =
 
                       let dest_loc = any_from_prob_ls prob_ls in
 
-                      {u' with 
-                        Unit.ac = [Walk (Unit.make_path_to reg.R.a u' dest_loc, 0.0)];
-                        Unit.tactmem = if (Random.int 4 = 0) then Unit.TactMem.empty else u'.Unit.tactmem }
+                      {u with 
+                        Unit.ac = [Walk (Pathfind.path_to reg u dest_loc, 0.0)];
+                        Unit.tactmem = if (Random.int 4 = 0) then Unit.TactMem.empty else u.Unit.tactmem }
                     )
                   )
               )
@@ -624,17 +653,21 @@ let static_abilities dt u reg =
 
 
 (* helper function *)
-(* run simulation for a single unit, return reg and need_input *)
-let run_for_one dt u s (reg, astr, need_input) =
+(* changes to the actors registry, collected while a region is simulated 
+   and applied after all regions of the step are done *)
+type actor_op = ActorUpdate of Unit.t * region_id | ActorRemove of Unit.t
+
+let apply_actor_op astr = function
+  | ActorUpdate (u, rid) -> Org.Astr.update_from_unit u rid astr
+  | ActorRemove u -> Org.Astr.remove_from_unit u astr
+
+(* run simulation for a single unit, return reg, rm, actor ops and need_input *)
+let run_for_one dt u s (reg, rm, ops, need_input) =
   (* move and adjust *)
   let u' = u |> move reg.R.a reg.R.e dt |> adjust reg.R.a in
 
   (* fire projectiles, etc *)
-  let u', reg, rm = 
-    let rm = s.geo.G.rm.(s.geo.G.currid) in
-    actions_with_objects (u', reg, rm) 
-  in
-  s.geo.G.rm.(s.geo.G.currid) <- rm;
+  let u', reg, rm = actions_with_objects (u', reg, rm) in
 
   (*
   (* timed actions - affects other units, overshadows old ue and u' *)
@@ -698,23 +731,21 @@ let run_for_one dt u s (reg, astr, need_input) =
     | (Lookaround _)::_ | [] ->
       ( (* add intelligence for units that are not directly controlled *)
         if Unit.get_controller u' = None then 
-        ( let astr_upd = Org.Astr.update_from_unit u' rid astr in
-          
-          (* try to pick up items - Should be probably somewhere else *)
+        ( (* try to pick up items - Should be probably somewhere else *)
           let u' = pick_up_items (u', reg) in
           (* /end picking up items *)
 
           let u'' = (u' |> intel s.geo s.astr reg s.pol ue) in
-          (updateu u'', Org.Astr.update_from_unit u'' rid astr_upd, need_input) )
+          (updateu u'', rm, ActorUpdate (u'', rid) :: ops, need_input) )
         (* or wait for input *)
         else
-          (updateu u', Org.Astr.update_from_unit u' rid astr , u'::need_input)
+          (updateu u', rm, ActorUpdate (u', rid) :: ops, u'::need_input)
       )
     | _ -> 
-      (updateu u', Org.Astr.update_from_unit u' rid astr, need_input)
+      (updateu u', rm, ActorUpdate (u', rid) :: ops, need_input)
   )
   else 
-  (removeu u', Org.Astr.remove_from_unit u' astr, need_input)
+  (removeu u', rm, ActorRemove u' :: ops, need_input)
 
 let transfer_from reg pol controller_id (geo, astr) =
   E.fold (fun (geo_acc, astr_acc) u -> 
@@ -722,53 +753,113 @@ let transfer_from reg pol controller_id (geo, astr) =
   ) (geo, astr) reg.R.e
 
 
-(* main simulation function *)
-let run dt s =
-  let def_dt = 0.025 in
-  (* def_dt time step *)
-  let rec iterate dt s =
-    if s.rem_dt +. dt > def_dt then
+(* A unit waiting at rest only heals and counts the time until the end of 
+   its wait, so it is put to sleep until then. It is woken earlier when it is
+   changed from outside (damaged, pushed) or when its collision force changes *)
+let sleep_time def_dt u =
+  match u.Unit.ac with
+  | Wait (loc, w) :: _ when 
+      Unit.get_controller u = None &&
+      loc = u.Unit.loc &&
+      vec_len2 u.Unit.vel < 0.01 &&
+      vec_len2 (u.Unit.pos --. vec_of_loc loc) < 0.01 &&
+      (match Unit.get_sp u with Species.Slime, _ -> false | _ -> true) ->
+        let t = Unit.get_reaction u -. w in
+        if t > 2.0 *. def_dt then t else 0.0
+  | _ -> 0.0
+
+(* what happened to the unit while it slept *)
+let catch_up slept u =
+  if slept <= 0.0 then u else
+  ( let u = Unit.heal (0.1*.slept) u in
+    let ac = 
+      match u.Unit.ac with 
+      | Wait (loc, w) :: tl -> Wait (loc, w +. slept) :: tl 
+      | ac -> ac in
+    {u with Unit.ac = ac; Unit.ntfy = progress_ntfy slept u.Unit.ntfy} )
+
+(* At most max_steps_per_run steps are simulated by one call of run. The time
+   left beyond max_backlog_steps is dropped, so that after a stall or at a high game 
+   speed the game slows down for a moment instead of stalling the next frames *)
+let max_steps_per_run = 8
+let max_backlog_steps = 4.0
+
+(* how far the drawing is between the previous and the current step *)
+let interpolation_alpha s = max 0.0 (min 1.0 (s.rem_dt /. s.opts.State.Options.step_dt))
+
+(* simulate one region for a step of def_dt. 
+   Only the region itself is modified, the changes of its meta info and of 
+   the actors are returned to be merged, so the regions of a step are independent *)
+let run_region def_dt s reg =
+  let rid = reg.R.rid in
+
+  E.save_prev reg.R.e;
+
+  (* update projectiles *)
+  let reg = Simobj.upd_projectiles def_dt reg in 
+  (* update energy spots *)
+  let reg = Simobj.upd_energyspots def_dt reg in
+  (* update other movable objects *)
+  let reg = Simobj.upd_movls def_dt reg in
+
+  (* update units *)
+  collide reg.R.e;
+  wake_on_collisions reg.R.e;
+  let upd_reg, upd_rm, ops, need_input = 
+    E.fold 
+      ( fun ((aa_reg,_,_,_) as acc) u ->
+          (* get u from the accumulator *)
+          ( match E.id (u.Unit.id) aa_reg.R.e with
+            | Some u when E.doze def_dt u aa_reg.R.e -> acc
+            | Some u -> 
+                let u = catch_up (E.take_slept u aa_reg.R.e) u in
+                let (aa_reg',_,_,_) as acc' = run_for_one def_dt u s acc in
+                ( match E.id (u.Unit.id) aa_reg'.R.e with
+                  | Some u' -> 
+                      let t = sleep_time def_dt u' in
+                      if t > 0.0 then E.put_to_sleep u' t aa_reg'.R.e
+                  | None -> () );
+                acc'
+            | None -> acc
+          )
+      ) (reg, s.geo.G.rm.(rid), [], []) reg.R.e in
+  
+  (* update allocated movables *)
+  let upd_rm = {upd_rm with RM.alloc = R.decompose_nonplayer_only true upd_reg} in
+  (upd_reg, upd_rm, List.rev ops, need_input)
+
+(* the regions simulated on a step: current + neighboring *)
+let regions_to_run s =
+  let nb = G.only_nb_ls s.geo in
+  if s.opts.State.Options.all_neighbours then 
+    G.curr s.geo :: nb
+  else 
+    G.curr s.geo :: (List.filter (fun _ -> Random.int 2 = 0) nb)
+
+(* simulation of the time dt *)
+let run_dt dt s =
+  let def_dt = s.opts.State.Options.step_dt in
+  (* def_dt time step, n steps are done already.
+     Returns the state and the time dropped from the backlog *)
+  let rec iterate n dt s =
+    if s.rem_dt +. dt > def_dt && n >= max_steps_per_run then
+      let rem_dt = min (max_backlog_steps *. def_dt) (s.rem_dt +. dt) in
+      ({s with rem_dt = rem_dt}, s.rem_dt +. dt -. rem_dt)
+    else if s.rem_dt +. dt > def_dt then
     (
-      (*
-      let b_compute_neighbors = Random.int 4 = 0 in
-      let gen_reg_list geo = 
-        if b_compute_neighbors then G.curnb_ls geo else [G.curr geo] in
-      *)
-      let gen_reg_list geo = 
-        G.curr geo :: (List.filter (fun _ -> Random.int 2 = 0) (G.only_nb_ls geo)) in
+      let reg_list = Rng.use (step_rng s rng_key_select) (fun () -> regions_to_run s) in
 
-      let reg_list = gen_reg_list s.geo in
+      (* simulate current + neighboring regions, each one with its own random stream *)
+      let results = 
+        List.map (fun reg -> Rng.use (step_rng s reg.R.rid) (fun () -> run_region def_dt s reg)) reg_list in
 
-      (* simulate current + neighboring regions *)
+      (* merge *)
       let geo1, astr1, need_input = 
-        List.fold_left ( fun (acc_geo, acc_astr, acc_need_input) reg ->
-          let rid = reg.R.rid in
-
-          (* update projectiles *)
-          let reg = Simobj.upd_projectiles def_dt reg in 
-          (* update energy spots *)
-          let reg = Simobj.upd_energyspots def_dt reg in
-          (* update other movable objects *)
-          let reg = Simobj.upd_movls def_dt reg in
-
-          (* update units *)
-          let upd_reg, upd_astr, upd_acc_need_input = 
-            E.fold 
-              ( fun ((aa_reg,_,_) as acc) u ->
-                  (* get u from the accumulator *)
-                  ( match E.id (u.Unit.id) aa_reg.R.e with
-                    | Some u -> run_for_one def_dt u s acc
-                    | None -> acc
-                  )
-              ) (reg, acc_astr, acc_need_input) reg.R.e in
-          
-          (* update allocated movables *)
-          acc_geo.G.rm.(rid) <- 
-            { acc_geo.G.rm.(rid) with RM.alloc = R.decompose_nonplayer_only true upd_reg };
-          
-          (* return updated geo *)
-          (G.upd upd_reg acc_geo, upd_astr, upd_acc_need_input)
-        ) (s.geo, s.astr, []) reg_list in
+        List.fold_left ( fun (acc_geo, acc_astr, acc_need_input) (upd_reg, upd_rm, ops, need_input) ->
+          acc_geo.G.rm.(upd_reg.R.rid) <- upd_rm;
+          let acc_astr = List.fold_left apply_actor_op acc_astr ops in
+          (G.upd upd_reg acc_geo, acc_astr, need_input @ acc_need_input)
+        ) (s.geo, s.astr, []) results in
 
       (* transfer units *)
       (* get the list of updated regions *)
@@ -776,16 +867,21 @@ let run dt s =
         List.map (fun reg -> match G.getro reg.R.rid geo1 with Some r -> r | _ -> failwith "Sim.run, no region found") reg_list
       in
       let geo2,astr2 = 
-        List.fold_left (fun geo_astr_acc reg ->
-          transfer_from reg s.State.pol s.State.controller_id geo_astr_acc) (geo1,astr1) reg_list_1 in
+        Rng.use (step_rng s rng_key_transfer) (fun () ->
+          List.fold_left (fun geo_astr_acc reg ->
+            transfer_from reg s.State.pol s.State.controller_id geo_astr_acc) (geo1,astr1) reg_list_1 ) in
+
+      (* the simulated regions are changed in place *)
+      List.iter (fun reg -> Savegame.touch reg.R.rid) reg_list;
 
+      let step = s.step + 1 in
       if need_input = [] then
-        iterate (s.rem_dt +. dt -. def_dt) {s with geo = geo2; astr = astr2; rem_dt = 0.0;}
+        iterate (n+1) (s.rem_dt +. dt -. def_dt) {s with geo = geo2; astr = astr2; rem_dt = 0.0; step = step}
       else
-        {s with rem_dt = s.rem_dt +. dt; geo = geo2; astr = astr2; cm=CtrlM.WaitInput need_input}
+        ({s with rem_dt = s.rem_dt +. dt; geo = geo2; astr = astr2; cm=CtrlM.WaitInput need_input; step = step}, 0.0)
     )
     else
-      {s with rem_dt = s.rem_dt +. dt}
+      ({s with rem_dt = s.rem_dt +. dt}, 0.0)
   in
 
   match s.cm with
@@ -794,7 +890,8 @@ let run dt s =
       let step_dt = 10.0 in
       let number = ( s.State.top_rem_dt /. step_dt ) |> floor |> int_of_float  in
       let number = if number > 0 then 1 else 0 in
-      let upd_geo, upd_astr = fold_lim (fun ga _ -> Top.run 1.0 s.pol ga) (s.geo, s.astr) 1 number in
+      let upd_geo, upd_astr = 
+        fold_lim (fun ga i -> Top.run (step_rng {s with step = s.step + i} rng_key_top) 1.0 s.pol ga) (s.geo, s.astr) 1 number in
       let upd_atlas = 
         if s.State.atlas.Atlas.currid <> s.State.geo.G.currid then
           Global.Atlas.update s.State.pol upd_geo s.State.atlas 
@@ -807,17 +904,20 @@ let run dt s =
         State.atlas = upd_atlas;
         State.top_rem_dt = 
           s.State.top_rem_dt -. float number *. step_dt; 
+        State.step = s.State.step + number;
 
         State.clock_last_alive_check = s.State.clock
       }
   | CtrlM.Normal -> 
       
       let simulate s =
-        let ns = iterate dt s in
+        let ns, dropped = iterate 0 dt s in
         (* update vision *)
         Vision.update_sight (Some ns.State.controller_id) (G.curr ns.State.geo) ns.State.vision;
-        let new_clock = State.Clock.add dt ns.State.clock in
-        {ns with State.top_rem_dt = ns.State.top_rem_dt +. dt; State.clock = new_clock } 
+        (* the time that is dropped is not simulated, the clock and the world do not advance by it *)
+        let sim_dt = dt -. dropped in
+        let new_clock = State.Clock.add sim_dt ns.State.clock in
+        {ns with State.top_rem_dt = ns.State.top_rem_dt +. sim_dt; State.clock = new_clock } 
       in
 
       (* check if the player is still alive *)
@@ -847,3 +947,37 @@ let run dt s =
   | CtrlM.Died t ->
       {s with cm = CtrlM.Died (t+.dt)}
 
+(* main simulation function *)
+let run dt s = State.with_unit_ids (run_dt dt) s
+
+
+(* the edge (or stairs) the player is likely to take next: the closest one within a few tiles *)
+let predict_exit s =
+  let reg = G.curr s.State.geo in
+  let a = reg.R.a in
+  let player = ref None in
+  E.iter (fun u -> if Unit.get_controller u = Some s.State.controller_id then player := Some u) reg.R.e;
+  match !player with
+  | Some u ->
+      let margin = 5 in
+      let (i,j) = u.Unit.loc in
+      let stairs = 
+        List.map (fun (st, (si,sj)) -> 
+          ((match st with R.Obj.StairsDown -> Down | R.Obj.StairsUp -> Up), max (abs (si-i)) (abs (sj-j)))
+        ) reg.R.obj.R.Obj.stairsls in
+      let candidates =
+        (West, i) :: (East, Tiles.w a - 1 - i) :: (South, j) :: (North, Tiles.h a - 1 - j) :: stairs in
+      List.fold_left (fun acc (dir, d) ->
+        match acc with
+        | Some (_, dmin) when dmin <= d -> acc
+        | _ when d <= margin -> Some (dir, d)
+        | _ -> acc
+      ) None candidates
+      |> (function Some (dir, _) -> Some dir | None -> None)
+  | None -> None
+
+(* prefetch the regions the player is heading to, called when the game loop is idle *)
+let prefetch s =
+  match s.State.cm, predict_exit s with
+  | CtrlM.Normal, Some dir -> Globalmove.prefetch dir s.State.geo
+  | _ -> false
@@ -17,87 +17,122 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
 open Base
 open Common
           
-let find_target pj nb_ls = 
-  (* minimize *)
-  let minimize_this u = 
-    let dvec = (u.Unit.pos --. pj.Proj.pos) in
-    let touch u = vec_dot_prod dvec pj.Proj.vel in
-    let t = touch u in 
-    if t > 0.0 && (vec_len dvec < Unit.get_radius u) then 
-      t +. vec_len dvec 
-    else 
-      infinity in
-  let x, _ =
-    List.fold_left 
-      ( fun (ou_best, v_best) u ->
-          let v = minimize_this u in
-          if v >= v_best then (ou_best, v_best) else (Some u, v)
-      ) (None, 100.0) nb_ls in
-  x
+(* Entry of the segment (x0,y0)-(x0+dx,y0+dy) into the circle (cx,cy,r), 
+   as the fraction 0..1 of the segment, or infinity if it misses.
+   The segment starting inside hits at 0, if the center is ahead *)
+let segment_circle x0 y0 dx dy cx cy r =
+  let fx = x0 -. cx and fy = y0 -. cy in
+  let c = fx*.fx +. fy*.fy -. r*.r in
+  if c <= 0.0 then
+    (if fx*.dx +. fy*.dy < 0.0 then 0.0 else infinity)
+  else
+  ( let a = dx*.dx +. dy*.dy in
+    let b = 2.0 *. (fx*.dx +. fy*.dy) in
+    let disc = b*.b -. 4.0*.a*.c in
+    if a = 0.0 || disc < 0.0 then infinity else
+    ( let s = (-. b -. sqrt disc) /. (2.0 *. a) in
+      if s >= 0.0 && s <= 1.0 then s else infinity ) )
 
-let upd_projectiles dt reg = 
-  let ls = reg.R.obj.R.Obj.projls in
-  (* move *)
-  let ls1 = List.map (fun pj -> Proj.move dt pj) ls in
+(* Fraction 0..1 of the segment (x0,y0)-(x0+dx,y0+dy) where it enters the first
+   cell that is blocked, or infinity. The cells are walked in the order the segment
+   crosses them (cell (i,j) is [i-0.5,i+0.5) x [j-0.5,j+0.5)). The cell it starts in
+   is not tested, a projectile leaving an obstacle (e.g. a door that closed) is not stopped *)
+let segment_cells blocked x0 y0 dx dy =
+  let ux = x0 +. 0.5 and uy = y0 +. 0.5 in
+  let i0 = int_of_float (floor ux) and j0 = int_of_float (floor uy) in
+  let i1 = int_of_float (floor (ux +. dx)) and j1 = int_of_float (floor (uy +. dy)) in
+  let si = if dx > 0.0 then 1 else -1 and sj = if dy > 0.0 then 1 else -1 in
+  (* the fraction where the next vertical (horizontal) cell border is crossed and the step between them *)
+  let border u i d = if d > 0.0 then (float (i+1) -. u) /. d else if d < 0.0 then (float i -. u) /. d else infinity in
+  let delta d = if d <> 0.0 then abs_float (1.0 /. d) else infinity in
+  let ddx = delta dx and ddy = delta dy in
+  (* cells to cross, the start cell is the one with n = total *)
+  let total = abs (i1-i0) + abs (j1-j0) in
+  let rec walk i j t tx ty n =
+    if n < total && blocked (i,j) then t
+    else if (i = i1 && j = j1) || n = 0 then infinity
+    else if tx < ty then walk (i+si) j tx (tx +. ddx) ty (n-1)
+    else walk i (j+sj) ty tx (ty +. ddy) (n-1)
+  in
+  walk i0 j0 0.0 (border ux i0 dx) (border uy j0 dy) total
 
-  (* filter outside *)
-  let ls2 = List.filter 
-    (fun proj -> Area.is_within reg.R.a (loc_of_vec proj.Proj.pos)) ls1 in
+(* the slot of the first unit on the way of the projectile from (x0,y0) by (dx,dy) 
+   and the fraction of the way, the candidates are the units in the cells around the way,
+   within the largest radius of the units (max_r) *)
+let find_target ue max_r x0 y0 dx dy =
+  let (i0, j0) = loc_of_vec (x0, y0) and (i1, j1) = loc_of_vec (x0 +. dx, y0 +. dy) in
+  let m = max 1 (int_of_float (ceil max_r)) in
+  let best = ref (-1) and best_s = ref infinity in
+  for i = min i0 i1 - m to max i0 i1 + m do
+    for j = min j0 j1 - m to max j0 j1 + m do
+      E.iter_cell_slots ue i j (fun k ->
+        let s = segment_circle x0 y0 dx dy ue.E.px.(k) ue.E.py.(k) ue.E.radius.(k) in
+        if s < !best_s then (best := k; best_s := s) )
+    done
+  done;
+  (!best, !best_s)
 
-  (* slowdown *)
-  let ls3 = List.map (fun pj ->
-      let tile = Area.get reg.R.a (loc_of_vec pj.Proj.pos) in
-      if not (Tile.can_walk (Tile.classify tile)) then
-        let mv = pj.Proj.item.Proj.mass %%. pj.Proj.vel in
-        let mv_len = vec_len mv in
-        let dmv = 10.0 *. mv_len *. dt in
-        let mv' = (max (mv_len -. dmv) 0.0 /. mv_len) %%. mv in
-        Proj.({pj with vel = (1.0/.pj.item.mass) %%. mv'})
+(* Move the projectiles, slow them down in obstacles, remove the slow ones and 
+   the ones that left the region, strike the units. One pass over the pool.
+   The whole way of a step is tested, so a projectile stops at the first obstacle
+   or unit on its way, however fast it is *)
+let upd_projectiles dt reg = 
+  let d = reg.R.obj.R.Obj.projs in
+  let a = reg.R.a in
+  let ue = reg.R.e in
+  let max_r = if Projs.length d > 0 then E.max_radius ue else 0.0 in
+  for k = Projs.length d - 1 downto 0 do
+    let x0 = d.Projs.px.(k) and y0 = d.Projs.py.(k) in
+    let vx0 = d.Projs.vx.(k) and vy0 = d.Projs.vy.(k) in
+    let mass = d.Projs.mass.(k) in
+    (* move *)
+    let c = -. d.Projs.drag.(k) /. mass in
+    let vx = vx0 +. dt *. c *. vx0 and vy = vy0 +. dt *. c *. vy0 in
+    let x = x0 +. (dt *. 0.5) *. (vx +. vx0) and y = y0 +. (dt *. 0.5) *. (vy +. vy0) in
+    if d.Projs.tp.(k) = Proj.EngCharge then d.Projs.dmgmult.(k) <- exp(-0.1 *. dt) *. d.Projs.dmgmult.(k);
+    (* stop at the first obstacle on the way *)
+    let sw = segment_cells (fun loc -> Tiles.is_within a loc && not (Tiles.can_walk a loc)) x0 y0 (x -. x0) (y -. y0) in
+    let x, y = if sw < 1.0 then (x0 +. sw *. (x -. x0), y0 +. sw *. (y -. y0)) else (x, y) in
+    let loc = loc_of_vec (x, y) in
+    if not (Tiles.is_within a loc) then
+      Projs.remove d k
+    else
+    ( (* slowdown *)
+      let slow = if sw < 1.0 || not (Tiles.can_walk a loc) then max (1.0 -. 10.0 *. dt) 0.0 else 1.0 in
+      let vx = slow *. vx and vy = slow *. vy in
+      let v2 = vx*.vx +. vy*.vy in
+      let too_slow = 
+        match d.Projs.tp.(k) with
+        | Proj.EngCharge -> v2 <= 0.1 || d.Projs.dmgmult.(k) <= 0.1
+        | _ -> v2 <= 0.5 in
+      if too_slow then 
+        Projs.remove d k
       else
-        pj
-    ) ls2 in
-  
-  (* filter slow *)
-  let ls3 = 
-    List.filter (fun proj -> 
-      match proj.Proj.item.Proj.tp with
-      | Proj.EngCharge -> vec_len2 proj.Proj.vel > 0.1 && proj.Proj.item.Proj.dmgmult > 0.1 
-      | _ -> vec_len2 proj.Proj.vel > 0.5
-    ) ls3 in
-
-  (* damage *)
-  let ls4, ue =
-    let rec next_proj (lsacc, ueacc) = function 
-      | pj::tl ->
-          let nb = E.collisions_nb_vec pj.Proj.pos ueacc in
-          ( match find_target pj nb with
-              Some u ->
-                let dmgmult = pj.Proj.item.Proj.dmgmult in
-                
-                let mv = pj.Proj.item.Proj.mass %%. pj.Proj.vel in
-                let mv_len = vec_len mv in
-                let strike = 10.0 *. mv_len *. dt in
-                let mv' = (max (mv_len -. strike) 0.0 /. mv_len) %%. mv in
-                let pj' = Proj.({pj with vel = (1.0/.pj.item.mass) %%. mv'}) in
-                
-                let u' = Unit.damage (strike, mv, dmgmult) u in
-
-                next_proj (pj'::lsacc, E.upd u' ueacc) tl
-
-            | _ -> next_proj (pj::lsacc, ueacc) tl
-          )
-      | _ -> (lsacc, ueacc)
-    in
-    next_proj ([], reg.R.e) ls3
-  in
-
-  (* E.at_loc  reg.R.e *)
-  R.({reg with obj = {reg.obj with Obj.projls = ls4}; e = ue})
+      ( (* damage the first unit on the way *)
+        match find_target ue max_r x0 y0 (x -. x0) (y -. y0) with
+        | (ku, s) when ku >= 0 ->
+            let mvx = mass *. vx and mvy = mass *. vy in
+            let strike = 10.0 *. sqrt (mvx*.mvx +. mvy*.mvy) *. dt in
+            let u' = Unit.damage (strike, (mvx, mvy), d.Projs.dmgmult.(k)) ue.E.units.(ku) in
+            ignore (E.upd u' ue);
+            let f = max (1.0 -. 10.0 *. dt) 0.0 in
+            d.Projs.px.(k) <- x0 +. s *. (x -. x0);
+            d.Projs.py.(k) <- y0 +. s *. (y -. y0);
+            d.Projs.vx.(k) <- f *. vx;
+            d.Projs.vy.(k) <- f *. vy
+        | _ ->
+            d.Projs.px.(k) <- x;
+            d.Projs.py.(k) <- y;
+            d.Projs.vx.(k) <- vx;
+            d.Projs.vy.(k) <- vy )
+    )
+  done;
+  reg
 
  
 let add proj reg =
-  let ls = reg.R.obj.R.Obj.projls in
-  R.({reg with obj = {reg.obj with Obj.projls = proj::ls}})
+  Projs.add proj reg.R.obj.R.Obj.projs;
+  reg
 
 
 let toggle_door u loc reg =
@@ -124,7 +159,7 @@ let toggle_door u loc reg =
     ( match Area.get oa loc with
       | Some (R.Obj.Door s) -> 
           Area.set oa loc (Some (obj_inv (R.Obj.Door s)));
-          Area.set ta loc (tile_inv (Area.get ta loc));
+          Tiles.set ta loc (tile_inv (Tiles.get ta loc));
       | _ -> ()
     );
     reg
@@ -141,7 +176,7 @@ let toggle_bonus_tower loc (u, reg, rm) =
     ( match Area.get oa loc with
       | Some ((R.Obj.BonusTower true) as obj) -> 
           Area.set oa loc (Some (R.Obj.BonusTower false));
-          Area.set ta loc (Tile.BonusTower false);
+          Tiles.set ta loc (Tile.BonusTower false);
 
           let core = Unit.get_core u in
           let prop = core.Unit.Core.prop in
@@ -48,12 +48,21 @@ module Clock = struct
 end
 
 module Options = struct
-  type t = {game_speed: int}
+  type t = {game_speed: int; all_neighbours: bool; step_dt: float}
 
-  let default = {game_speed = 0}
+  (* all_neighbours: simulate every neighboring region on each step, 
+     otherwise a random half of them.
+     step_dt: time step of the simulation (s) *)
+  let default = {game_speed = 0; all_neighbours = false; step_dt = 0.025}
 
-  let speedup ({game_speed}) = {game_speed = min (game_speed + 1) 10}
-  let slowdown ({game_speed}) = {game_speed = max (game_speed - 1) (-10)}
+  (* the time step can be set in the environment (WANDERERS_STEP_DT) *)
+  let from_env o =
+    match float_of_string (Sys.getenv "WANDERERS_STEP_DT") with
+    | x -> {o with step_dt = max 0.005 (min 0.1 x)}
+    | exception (Not_found | Failure _) -> o
+
+  let speedup o = {o with game_speed = min (o.game_speed + 1) 10}
+  let slowdown o = {o with game_speed = max (o.game_speed - 1) (-10)}
 end
 
 type t =
@@ -85,9 +94,57 @@ type t =
 
     random_seed : string;
 
+    (* random streams of the simulation are derived from the seed and the step number *)
+    world_seed : int;
+    step : int;
+
+    (* id of the next created unit *)
+    next_unit_id : int;
+
     console : Console.t;
   }
 
+(* random stream for a part (key) of the current simulation step *)
+let step_rng s key = Rng.derive [|s.world_seed; s.step; key|]
+
+(* keys of the parts of a step, regions use their ids *)
+let rng_key_select = -1
+let rng_key_transfer = -2
+let rng_key_top = -3
+let rng_key_input = -4
+
+(* Unit ids come from the counter Unit.next_id. It is taken from the state before 
+   running f and stored back after, so it is saved and replayed with the state *)
+let with_unit_ids f s =
+  Unit.next_id := s.next_unit_id;
+  let s = f s in
+  {s with next_unit_id = !Unit.next_id}
+
+let seed_of_string s =
+  let max_seed = 1000000000 in
+  Base.fold_lim (fun a i -> (a*256 + Char.code s.[i]) mod (max_seed/512)) 0 0 (String.length s - 1) 
+
+(* simulate the new world for a while before the player enters it *)
+let warm_up world_seed pol ga =
+  let step = ref 0 in
+  let simulate speedup steps ga = 
+    fold_lim (fun ga _ -> 
+      incr step;
+      ga |> Top.run (Rng.derive [|world_seed; - !step; rng_key_top|]) speedup pol
+    ) ga 0 steps in
+  let d = 30 in
+  ga
+  |> simulate  1.0 d
+  |> simulate  2.0 d 
+  |> simulate  4.0 d 
+  |> simulate 16.0 d 
+  |> simulate 32.0 (4*d) 
+  |> simulate 16.0 d 
+  |> simulate  8.0 d 
+  |> simulate  4.0 d 
+  |> simulate  2.0 d 
+  |> simulate  1.0 d 
+
 let make w h used_seed debug = 
   let facnum = default_factions_number in
   let geo_w = 45 in
@@ -95,21 +152,8 @@ let make w h used_seed debug =
   let pol = Politics.make_variety facnum in
   let geo = Genmap.Cube.generate geo_w geo_h 20 facnum in
   let astr = Org.Astr.make_empty (Array.length geo.G.rm) in
-  let geo, astr = 
-    let simulate speedup steps ga = fold_lim (fun ga _ -> ga |> Top.run speedup pol) ga 0 steps in
-    let d = 30 in
-    (geo, astr) 
-    |> simulate  1.0 d
-    |> simulate  2.0 d 
-    |> simulate  4.0 d 
-    |> simulate 16.0 d 
-    |> simulate 32.0 (4*d) 
-    |> simulate 16.0 d 
-    |> simulate  8.0 d 
-    |> simulate  4.0 d 
-    |> simulate  2.0 d 
-    |> simulate  1.0 d 
-  in
+  let world_seed = seed_of_string used_seed in
+  let geo, astr = warm_up world_seed pol (geo, astr) in
   (* add the player *)
   (* find a good region *)
   let player_faction = match Random.int 5 with 0 -> 0 | 1 -> 2 | 2 -> 5 | 3 -> 7 | _ -> 10 in
@@ -205,25 +249,23 @@ let make w h used_seed debug =
     astr;
     vision = (
       let a = (G.curr geo').R.a in
-      Area.make (Area.w a) (Area.h a) 0 
+      Area.make (Tiles.w a) (Tiles.h a) 0 
     );
     atlas;
     clock = Clock.zero;
     clock_last_alive_check = Clock.zero;
-    opts = Options.default;
+    opts = Options.from_env Options.default;
     debug;
     random_seed = used_seed;
+    world_seed;
+    step = 0;
+    next_unit_id = !Unit.next_id;
     console = Console.make()
   }
 
 
 let init seed b_debug =
-  let max_seed = 1000000000 in
-  let hash_string s =
-    Base.fold_lim (fun a i -> (a*256 + Char.code s.[i]) mod (max_seed/512)) 0 0 (String.length s - 1) 
-  in
-  
-  Random.init (hash_string seed);
+  Random.init (seed_of_string seed);
   
   make 25 16 seed b_debug
 
@@ -286,9 +328,9 @@ module Msg = struct
     | Delete
 end
 
-let respond s =
+let respond_one s =
   let reg = G.curr s.geo in
-  let validate ij = Area.put_inside reg.R.a ij in
+  let validate ij = Tiles.put_inside reg.R.a ij in
   
   (* update units lists in CtrlM *)
   let rec traverse e = 
@@ -742,6 +784,8 @@ let respond s =
           Msg.Confirm -> init_full None s.debug
         | _ -> s )
 
+let respond s msg = with_unit_ids (fun s -> respond_one s msg) s
+
 (* ~ game modes *)
 type game_mode = Play of t | Exit
 
@@ -57,40 +57,87 @@ let place_eval pol fac g rid =
 
 let get_difficulty g rid = RM.get_difficulty g.G.rm.(rid)
 
+(* Flat work arrays of the coarse world step, reused between runs.
+   growth keeps a copy of the region's row, updated as its factions grow.
+   migrate reads the populations as they were at the beginning of the pass:
+   it accumulates its transfers in the delta matrices (regions x factions) 
+   and applies them when all regions are done. So regions of a pass do not 
+   depend on the order in which they are processed. *)
+type work = 
+  { mutable len: int;
+    mutable facnum: int;
+    mutable pass: int;
+    mutable pop_row: int array;     (* populations of the region *)
+    mutable act_row: float array;   (* actions of the others on each faction *)
+    mutable place: float array;     (* place_eval, regions x factions ... *)
+    mutable place_pass: int array;  (* ... valid for the region if computed on this pass *)
+    mutable dpop: int array;        (* migration deltas, regions x factions *)
+    mutable dres: int array;        (* migration deltas of resources, per region *)
+  }
+
+let work = 
+  { len = 0; facnum = 0; pass = 0; pop_row = [||]; act_row = [||]; 
+    place = [||]; place_pass = [||]; dpop = [||]; dres = [||] }
+
+let prepare_work len facnum =
+  if work.len <> len || work.facnum <> facnum then
+  ( work.len <- len;
+    work.facnum <- facnum;
+    work.pop_row <- Array.make facnum 0;
+    work.act_row <- Array.make facnum 0.0;
+    work.place <- Array.make (len*facnum) 0.0;
+    work.place_pass <- Array.make len (-1);
+    work.dpop <- Array.make (len*facnum) 0;
+    work.dres <- Array.make len 0 )
+
+(* place_eval values are cached until the next pass *)
+let new_pass () = work.pass <- work.pass + 1
+
+let place pol fac g rid =
+  let base = rid * work.facnum in
+  if work.place_pass.(rid) <> work.pass then
+  ( for i = 0 to work.facnum - 1 do
+      work.place.(base + i) <- place_eval pol i g rid
+    done;
+    work.place_pass.(rid) <- work.pass );
+  work.place.(base + fac)
+
 let growth speedup pol g facnum rid =
-  let totpop = fold_lim (fun sum i -> sum + fget g rid i) 0 0 (facnum-1) in
+  let pop_row = work.pop_row in
+  for i = 0 to facnum-1 do
+    pop_row.(i) <- fget g rid i
+  done;
+  let totpop = Array.fold_left (+) 0 pop_row in
   let totx = float totpop in
 
-  (*
-  let pop_cond pred = fold_lim (fun sum i -> if pred i then sum + fget g rid i else sum) 0 0 (facnum-1) in
-  let pop_dont_like_me fac = pop_cond (fun other_fac -> pol.Politics.rel_act.(other_fac).(fac) < 0) in
-  *)
-
-  let actions_from_others fac =
-    fold_lim 
-      (fun sum i -> 
-          sum +. ( pol.Pol.rel_act.(i).(fac) *. float (fget g rid i) )) 
-      0.0 0 (facnum-1) in
- 
-  (*
-  let like_others fac =
-    fold_lim 
-      (fun sum i -> 
-          sum + ( pol.Politics.rel_like.(fac).(i) * fget g rid i )) 
-      0 0 (facnum-1) in
-  *)
+  let urbn = urbanization g rid in
+  let agro = ref (
+    fold_lim (fun sum i -> 
+      if pol.Pol.prop.(i).Pol.fsp = Domestic then sum + pop_row.(i) else sum
+    ) 0 0 (facnum-1) ) in
+
+  (* actions from others. 
+     The factions see the populations already updated by the previous ones, 
+     so pop_row, act_row and agro are kept up to date after each faction *)
+  let act_row = work.act_row in
+  for fac = 0 to facnum-1 do
+    let sum = ref 0.0 in
+    for i = 0 to facnum-1 do
+      sum := !sum +. pol.Pol.rel_act.(i).(fac) *. float pop_row.(i)
+    done;
+    act_row.(fac) <- !sum
+  done;
 
   (* go through all factions *)
   let dres_lat = Array.make facnum 0 in
 
   let run_faction i =
-    let pop = fget g rid i in
-    let x_actions = actions_from_others i in
-    let x_like = actions_from_others i in
+    let pop = pop_row.(i) in
+    let x_actions = act_row.(i) in
+    let x_like = act_row.(i) in
     
-    let x_place = place_eval pol i g rid in
+    let x_place = place pol i g rid in
 
-    let urbn = urbanization g rid in
     let xtot_penalty_sq = 
       let z = 1 + int_of_float (float totpop /. sqrt( float (1 + urbn) )) in 
       float (z * z) in
@@ -106,11 +153,10 @@ let growth speedup pol g facnum rid =
     (* economics *)
     let fcl = pol.Pol.prop.(i).Pol.cl in
     let frac = if totpop > 0 then float pop /. float totpop else 0.0 in
-    let agro = agriculture pol g rid in
 
     let slowdown = 0.05 *. speedup in
     (* production efficiency per person *)
-    let argx = (1.1 +. 0.1 *. float (urbn + round_prob (sqrt(float agro)) )) in
+    let argx = (1.1 +. 0.1 *. float (urbn + round_prob (sqrt(float !agro)) )) in
     (* production - adjust to the difficulty level of the region *)
     let argx = argx +. 0.065 *. get_difficulty g rid in
     (* consumption per person *)
@@ -134,11 +180,18 @@ let growth speedup pol g facnum rid =
 
     dres_lat.(i) <- edres;
     let pop' = ((x +. dx +. float edpop) |> round_prob |> rng) in
-    fset_lat g rid i (max 0 (pop' - fget_alloc g rid i))
+    fset_lat g rid i (max 0 (pop' - fget_alloc g rid i));
+
+    let dpop = fget g rid i - pop in
+    if dpop <> 0 then
+    ( pop_row.(i) <- pop + dpop;
+      for fac = 0 to facnum-1 do
+        act_row.(fac) <- act_row.(fac) +. pol.Pol.rel_act.(i).(fac) *. float dpop
+      done;
+      if pol.Pol.prop.(i).Pol.fsp = Domestic then agro := !agro + dpop )
   in
   for i = 0 to facnum-1 do
-    let pop = fget g rid i in
-    if pop > 0 then
+    if pop_row.(i) > 0 then
       run_faction i
   done;
 
@@ -154,50 +207,62 @@ let growth speedup pol g facnum rid =
     rset_lat g rid (Resource.zero)
 
 
+(* migration from the region, the transfers are accumulated in work.dpop and work.dres *)
 let migrate speedup pol g facnum rid =
   let total_pop = fold_lim (fun sum i -> sum + fget g rid i) 0 0 (facnum-1) in
+  let res_left = ref (Resource.numeric (rget_lat g rid)) in
   (* go through all factions *)
   for i = 0 to facnum-1 do
     let pop = fget g rid i in
-    let pop_lat = fget_lat g rid i in
+    let pop_left = ref (fget_lat g rid i) in
     let x = float pop in
     G.Me.iter 
       ( fun _ nrid ->
 
         if Random.int 4 = 0 && (pop > 0 || fget g nrid i > 0) then
-        ( let x_place = place_eval pol i g rid in
-          let x_nplace = place_eval pol i g nrid in
+        ( let x_place = place pol i g rid in
+          let x_nplace = place pol i g nrid in
           let boost = 1.0 +. 4.0 *. 
             if x_nplace>x_place then (x_nplace -. x_place) /. (abs_float(x_nplace) +. abs_float(x_place)) else 0.0 in
           
           let d = round_prob (0.008 *. speedup *. x *. boost) in
-          let d2 = min d (fget_lat g rid i) in
+          let d2 = min d !pop_left in
           let npop = fget g nrid i in
           
           let d3 = d2 |> min (pop - npop) |> max 0 in
 
-          let npop_lat = fget_lat g nrid i in
-          (* let npop_alloc = fget_alloc g nrid i in *)
-
           let d4 = in_range (0, def_max_pop - npop) d3 in
 
           (* move population *)
-          fset_lat g rid i (pop_lat - d4) ;
-          fset_lat g nrid i (npop_lat + d4) ;
+          pop_left := !pop_left - d4;
+          work.dpop.(rid*facnum + i) <- work.dpop.(rid*facnum + i) - d4;
+          work.dpop.(nrid*facnum + i) <- work.dpop.(nrid*facnum + i) + d4;
 
           (* move resources *)
-          let res_to_move = Resource.scale (float d4 /. float total_pop) (rget g rid) in
-          let cur_res_lat = rget_lat g rid in
-          let nb_res_lat = rget_lat g nrid in
-          let res_to_move_2 = Resource.intersection res_to_move cur_res_lat in
-          rset_lat g rid (Resource.subtract cur_res_lat res_to_move_2);
-          rset_lat g nrid (Resource.add nb_res_lat res_to_move_2);
+          let res_to_move = Resource.scale (float d4 /. float total_pop) (rget g rid) |> Resource.numeric in
+          let res_moved = res_to_move |> min !res_left |> max 0 in
+          res_left := !res_left - res_moved;
+          work.dres.(rid) <- work.dres.(rid) - res_moved;
+          work.dres.(nrid) <- work.dres.(nrid) + res_moved;
         )
       )
       g.G.nb.(rid)
       
   done
 
+let apply_migration g facnum =
+  for rid = 0 to work.len - 1 do
+    for i = 0 to facnum-1 do
+      let k = rid*facnum + i in
+      if work.dpop.(k) <> 0 then
+      ( fset_lat g rid i (fget_lat g rid i + work.dpop.(k));
+        work.dpop.(k) <- 0 )
+    done;
+    if work.dres.(rid) <> 0 then
+    ( rset_lat g rid (Resource.add (rget_lat g rid) (Resource.make work.dres.(rid)));
+      work.dres.(rid) <- 0 )
+  done
+
 
 let economics astr speedup pol g facnum rid =
   let totpop = fold_lim (fun sum i -> sum + fget g rid i) 0 0 (facnum-1) in
@@ -287,18 +352,23 @@ let sim_actors speedup pol (g, astr) =
   let accept_prob = 0.3 *. speedup in
   Simorg.run accept_prob pol ga_upd 
 
-let run speedup pol (g, astr) =
-  let facnum = fnum g in
-  let len = G.length g in
-  let execute func = 
-    for rid = 0 to len-1 do
-      if Random.int 2 = 0 then
-        func speedup pol g facnum rid;
-    done
-  in
-  execute growth;
-  execute (economics astr);
-  execute migrate;
-  
-  let g_astr' = sim_actors speedup pol (g, astr) in
-  g_astr'
+(* one step of the global simulation, all random numbers are taken from the stream rng *)
+let run rng speedup pol (g, astr) =
+  Rng.use rng (fun () ->
+    let facnum = fnum g in
+    let len = G.length g in
+    let execute func = 
+      new_pass ();
+      for rid = 0 to len-1 do
+        if Random.int 2 = 0 then
+          func speedup pol g facnum rid;
+      done
+    in
+    prepare_work len facnum;
+    execute growth;
+    execute (economics astr);
+    execute migrate;
+    apply_migration g facnum;
+    
+    sim_actors speedup pol (g, astr)
+  )
@@ -71,17 +71,15 @@ let species_img = function
 
 (* switch texture *)
 let switch_to_text () = 
-  glEnd();
-  glBindTexture gl_texture_2d texture.(0);
-  glBegin gl_quads
+  Batch.flush ();
+  glBindTexture gl_texture_2d texture.(0)
 
 let switch_to_tile () = 
-  glEnd();
-  glBindTexture gl_texture_2d texture.(0);
-  glBegin gl_quads
+  Batch.flush ();
+  glBindTexture gl_texture_2d texture.(0)
 
 (* choose color *)
-let set_color r g b a = glColor4f r g b a
+let set_color r g b a = Batch.set_color r g b a
 
 let draw_gl_scene draw_func =
   glClear  (gl_color_buffer_bit (*lor gl_depth_buffer_bit*)) ;		 (* Clear The Screen And The Depth Buffer *)
@@ -89,12 +87,11 @@ let draw_gl_scene draw_func =
   glTranslatef 0.0 0.0 0.0 ;
   set_color 1.0 1.0 1.0 1.0; 
   glBindTexture gl_texture_2d texture.(0);
-  glBegin gl_quads;		                
  
   draw_func();
 
   set_color 1.0 1.0 1.0 1.0; 
-  glEnd();
+  Batch.flush ();
   swap_buffers ()
 
 let biome_img b = 
@@ -486,16 +483,16 @@ let draw_barter t bar gr (i,j) =
 let is_visible_well vision ij = Area.get vision ij > 0 || i_see_all 
 let is_visible_somewhat area vision (px,py) = 
   let g (x,y) = (int_of_float x, int_of_float y) in
-  List.exists (fun loc -> Area.is_within area loc && Area.get vision loc > 0 && 
-      Tile.can_look(Tile.classify (Area.get area loc))) 
+  List.exists (fun loc -> Tiles.is_within area loc && Area.get vision loc > 0 && 
+      Tiles.can_look area loc) 
     [g(floor px, floor py); g(floor px, ceil py); g(ceil px, floor py); g(ceil px, ceil py);]
 
 
 (* Projectiles *)
 let draw_projectiles t reg vision =
-  let ls = reg.R.obj.R.Obj.projls in
+  let projs = reg.R.obj.R.Obj.projs in
 
-  List.iter 
+  Projs.iter 
     ( fun pj ->
         let dimg, dpos =
           match Proj.getdir pj with
@@ -543,7 +540,7 @@ let draw_projectiles t reg vision =
               (* Draw.draw_bb_vec (9.0, 17.0) pj.Proj.pos; *) 
           )
         )
-    ) ls
+    ) projs
 
 (* Stairs *)
 let draw_stairs t reg vision (stt, loc) =
@@ -628,7 +625,7 @@ let draw_movls t reg u vision =
 (* Area one tile *)
 let draw_area_tile_floor t reg rm vision (i,j) = 
   let visible, tile_opt =
-    if Area.get vision (i,j) > 0 || i_see_all then true, Some (Area.get reg.R.a (i,j)) 
+    if Area.get vision (i,j) > 0 || i_see_all then true, Some (Tiles.get reg.R.a (i,j)) 
     else false, Area.get reg.R.explored (i,j) in
 
   match tile_opt with
@@ -655,30 +652,32 @@ let draw_area_tile_floor t reg rm vision (i,j) =
           | Tile.WoodenFloor -> draw_obj (6,9) 
           | Tile.Door _ -> draw_obj (6,9)
           | _ -> () );
-        
-        (* draw items *)
-        if visible then
-        ( match Area.get reg.R.optinv (i,j) with
-          | Some inv -> 
-              for k = 0 to 2 do
-                match Inv.examine 0 k inv with
-                  Some bunch -> draw_bunch_no_text t bunch Draw.gr_map (i,j)
-                | None -> ()
-              done
-          | None -> ()
-        )
       )
   | None -> ()
 
+(* Items on the floor of one tile *)
+let draw_area_tile_items t reg vision (i,j) = 
+  if Area.get vision (i,j) > 0 || i_see_all then
+  ( match Area.get reg.R.optinv (i,j) with
+    | Some inv -> 
+        set_color 1.0 1.0 1.0 1.0;
+        for k = 0 to 2 do
+          match Inv.examine 0 k inv with
+            Some bunch -> draw_bunch_no_text t bunch Draw.gr_map (i,j)
+          | None -> ()
+        done
+    | None -> ()
+  )
+
 
 let door_is_east_west a (i,j) =
-  let g loc = if not (Area.is_within a loc) || Area.get a loc |> Tile.classify |> Tile.can_walk then 1 else 0 in
+  let g loc = if not (Tiles.is_within a loc) || Tiles.can_walk a loc then 1 else 0 in
   g (i-1,j) + g (i+1,j) >= g (i,j-1) + g (i, j+1) 
 
 (* Area one tile *)
 let draw_area_tile_obstacles t reg rm vision (i,j) = 
   let visible, tile_opt =
-    if Area.get vision (i,j) > 0 || i_see_all then true, Some (Area.get reg.R.a (i,j)) 
+    if Area.get vision (i,j) > 0 || i_see_all then true, Some (Tiles.get reg.R.a (i,j)) 
     else false, Area.get reg.R.explored (i,j) in
 
   match tile_opt with
@@ -719,6 +718,32 @@ let draw_area_tile_obstacles t reg rm vision (i,j) =
   | None -> ()
 
 
+(* Static layers: the floor and the obstacles of every row of the current region,
+   recorded once and replayed every frame. They depend only on the tiles, 
+   the vision and the explored area, so they are recorded again when the region, 
+   its tiles' version or the vision's version change *)
+module Layers = struct
+  let key = ref None
+  let floor = ref [||]
+  let obstacles = ref [||]
+
+  let get t reg rm vision =
+    let valid =
+      match !key with
+      | Some (rid, a, ver, ex, z, vver) -> 
+          rid = reg.R.rid && a == reg.R.a && ver = reg.R.a.Tiles.version && ex == reg.R.explored && 
+          z == vision && vver = !Vision.version
+      | None -> false
+    in
+    if not valid then
+    ( let w = Tiles.w reg.R.a and h = Tiles.h reg.R.a in
+      let row draw j = Batch.record (fun () -> for i = 0 to w-1 do draw t reg rm vision (i,j) done) in
+      floor := Array.init h (row draw_area_tile_floor);
+      obstacles := Array.init h (row draw_area_tile_obstacles);
+      key := Some (reg.R.rid, reg.R.a, reg.R.a.Tiles.version, reg.R.explored, vision, !Vision.version) );
+    (!floor, !obstacles)
+end
+
 (* Notification *)
 let draw_ntfy time u = 
   List.iter (fun (ev,t) -> 
@@ -746,6 +771,7 @@ let draw_ntfy time u =
 
 
 let draw_unit t s reg eval_unit_strength u_controlled_strength u =
+  let u = {u with Unit.pos = E.interpolated_pos (Sim.interpolation_alpha s) u reg.R.e} in
   let visible_well = is_visible_well s.State.vision u.Unit.loc in
   let visible_somewhat = is_visible_somewhat reg.R.a s.State.vision u.Unit.pos in
   if visible_well || visible_somewhat then
@@ -878,8 +904,8 @@ let draw_state t s =
   let reg = G.curr s.State.geo in
   let cur_rm = s.State.geo.G.rm.(s.State.geo.G.currid) in
 
-  let area_w = Area.w reg.R.a in
-  let area_h = Area.h reg.R.a in
+  let area_w = Tiles.w reg.R.a in
+  let area_h = Tiles.h reg.R.a in
 
   (* units array *)
   let unit_ls_arr = Array.make_matrix area_w area_h [] in 
@@ -915,14 +941,19 @@ let draw_state t s =
     | None -> infinity 
   in
 
+  let floor_rows, obstacle_rows = Layers.get t reg cur_rm s.State.vision in
+
   for j = area_h-1 downto 0 do
     
-    (* floor, items, and stairs *)
+    (* floor *)
+    Batch.replay floor_rows.(j);
+
+    (* items, and stairs *)
     for i = 0 to area_w-1 do
       let ij = (i,j) in
 
-      (* tile *)
-      draw_area_tile_floor t reg cur_rm s.State.vision ij;
+      (* items *)
+      draw_area_tile_items t reg s.State.vision ij;
     
       (* stairs floor *)
       ( match stairs_arr.(i).(j) with
@@ -942,16 +973,14 @@ let draw_state t s =
       if j = 0 then draw_units_at i j;
     done;
 
-    for i = 0 to area_w-1 do
-      (* tile obstacles *)
-      draw_area_tile_obstacles t reg cur_rm s.State.vision (i,j);
-    done;
+    (* tile obstacles *)
+    Batch.replay obstacle_rows.(j);
   done;
   
   (* mist *)
   (
     let mist_img = (15,9) in
-    let known loc = Area.is_within reg.R.a loc && match Area.get reg.R.explored loc with Some _ -> true | _ -> false in
+    let known loc = Tiles.is_within reg.R.a loc && match Area.get reg.R.explored loc with Some _ -> true | _ -> false in
     
     let rnd (i,j) = cur_rm.RM.seed + + (i * 40591) lxor (j * 3571) in
     let timed_rnd (i,j) = ((t+rnd(i,j))/700) + rnd (i,j) in
@@ -14,6 +14,18 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. *)
 
+(*
+  Field of view by shadowcasting over the sight mask of a region.
+
+  A field of view is the sorted array of the visible cells (by index i*h + j).
+  They are cached per region, keyed by the origin and the radius, and dropped
+  when the tile grid is replaced or its version changes (a door is opened or
+  closed). So a unit that did not move gets its field of view for free.
+
+  Units do not keep their own sight, they query the region (can_see,
+  visible_cells_with, visible_units), which shares the cached fields.
+*)
+
 open Base
 open Common
 
@@ -25,24 +37,13 @@ let zero_area z =
     done
   done
 
-let add_sight a opt_ex z locmap (x0,y0) sight_distance =
+(* scan one octant, mark is called for the visible cells (mapped) *)
+let add_sight a mark locmap (x0,y0) sight_distance =
   let b loc = 
     let loc' = locmap loc in
-    Area.is_within a loc' &&
-    Tile.can_look (Tile.classify (Area.get a loc')) in
-
-  let mark =
-    match opt_ex with 
-      Some ex -> 
-      ( fun loc -> 
-          let mapped_loc = locmap loc in
-          Area.set z mapped_loc 1;
-          Area.set ex mapped_loc (Some (Area.get a mapped_loc)) )
-    | _ -> 
-      ( fun loc -> 
-          let mapped_loc = locmap loc in
-          Area.set z mapped_loc 1 )
-  in
+    Tiles.is_within a loc' && Tiles.can_look a loc' in
+
+  let mark loc = mark (locmap loc) in
 
   let rec scan range (xfl,yfl) (xfh,yfh) prev_x prev_yl prev_yh =
     let continue, range' = 
@@ -66,7 +67,7 @@ let add_sight a opt_ex z locmap (x0,y0) sight_distance =
                     | (dx,dy)::tl -> 
                         let lc = (x+dx,y+dy) in 
                         let mapped_lc = locmap lc in
-                        if Area.is_within a mapped_lc && not (Tile.can_look(Tile.classify (Area.get a mapped_lc))) then
+                        if Tiles.is_within a mapped_lc && not (Tiles.can_look a mapped_lc) then
                         ( mark lc );
                         wider_range tl
                     | [] -> ()
@@ -82,7 +83,7 @@ let add_sight a opt_ex z locmap (x0,y0) sight_distance =
                 )
                 else
                 ( (* mark walls in the field of sight *)
-                  if Area.is_within a (locmap (x,y)) then mark (x,y); 
+                  if Tiles.is_within a (locmap (x,y)) then mark (x,y); 
                   match opt_lower with
                   | Some yl' -> 
                       scan range' xyfl' (x,y-1) x yl' (y-1);
@@ -95,63 +96,131 @@ let add_sight a opt_ex z locmap (x0,y0) sight_distance =
   in
   scan (Some sight_distance) (x0+1,y0) (x0+1,y0+1) (x0) y0 (y0)
 
+let octants = 
+  [ (fun (x,y) -> ( x, y));
+    (fun (x,y) -> (-x, y));
+    (fun (x,y) -> ( x,-y));
+    (fun (x,y) -> (-x,-y));
+    (fun (x,y) -> ( y, x));
+    (fun (x,y) -> (-y, x));
+    (fun (x,y) -> ( y,-x));
+    (fun (x,y) -> (-y,-x));
+  ]
+
+(* cells marked by the current scan, by the id of the scan *)
+let stamp = ref [||]
+let stamp_id = ref 0
+
+(* visible cells from loc0 within the radius *)
+let compute_fov a loc0 radius =
+  let h = Tiles.h a in
+  let n = Tiles.w a * h in
+  if Array.length !stamp < n then stamp := Array.make n 0;
+  incr stamp_id;
+  let id = !stamp_id and st = !stamp in
+  let cells = ref [] in
+  let mark (i,j) =
+    if Tiles.is_within a (i,j) then
+    ( let k = i*h + j in
+      if st.(k) <> id then
+      ( st.(k) <- id; cells := k :: !cells ) )
+  in
+  if Tiles.is_within a loc0 then
+  ( mark loc0;
+    List.iter (fun locmap -> add_sight a mark (fun loc -> loc0 ++ (locmap (loc -- loc0))) loc0 radius) octants );
+  let arr = Array.of_list !cells in
+  Array.sort compare arr;
+  arr
+
+type fov_cache = {tiles: Tiles.t; version: int; fovs: (loc * int, int array) Hashtbl.t}
+
+let max_regions = 16
+let max_fovs = 512
 
+let cache : (region_id, fov_cache) Hashtbl.t = Hashtbl.create max_regions
 
-(* single mob sight *)
-let update_mob_sight reg sight_distance u =
-  let u' = 
-    let w = Area.w reg.R.a in
-    let h = Area.h reg.R.a in
-    if Area.w u.Unit.sight <> w || Area.h u.Unit.sight <> h then
-      {u with Unit.sight = Area.make w h 0} 
-    else 
-    ( zero_area u.Unit.sight; u )
+let fovs_of rid a =
+  let fresh () =
+    if Hashtbl.length cache >= max_regions then Hashtbl.reset cache;
+    let fc = {tiles = a; version = a.Tiles.version; fovs = Hashtbl.create 64} in
+    Hashtbl.replace cache rid fc;
+    fc.fovs
   in
-  let loc0 = u'.Unit.loc in
-  if Area.is_within reg.R.a loc0 then
-  ( Area.set u'.Unit.sight loc0 1;
-  );
-  List.iter
-    ( fun locmap -> add_sight reg.R.a None u'.Unit.sight
-        (fun loc -> loc0 ++ (locmap (loc -- loc0)) )
-        u'.Unit.loc sight_distance)
-    [ (fun (x,y) -> ( x, y));
-      (fun (x,y) -> (-x, y));
-      (fun (x,y) -> ( x,-y));
-      (fun (x,y) -> (-x,-y));
-      (fun (x,y) -> ( y, x));
-      (fun (x,y) -> (-y, x));
-      (fun (x,y) -> ( y,-x));
-      (fun (x,y) -> (-y,-x));
-    ];
-  u'
+  match Hashtbl.find cache rid with
+  | fc when fc.tiles == a && fc.version = a.Tiles.version -> fc.fovs
+  | _ -> fresh ()
+  | exception Not_found -> fresh ()
 
+(* visible cells of the region from loc within the radius (shared, do not modify) *)
+let fov reg loc radius =
+  let fovs = fovs_of reg.R.rid reg.R.a in
+  try Hashtbl.find fovs (loc, radius) with Not_found ->
+    let arr = compute_fov reg.R.a loc radius in
+    if Hashtbl.length fovs >= max_fovs then Hashtbl.reset fovs;
+    Hashtbl.replace fovs (loc, radius) arr;
+    arr
+
+let loc_of_cell reg k = let h = Tiles.h reg.R.a in (k / h, k mod h)
+
+(* is dst visible from src within the radius *)
+let can_see reg src dst radius =
+  Tiles.is_within reg.R.a dst &&
+  ( let (i,j) = dst in
+    let k = i * Tiles.h reg.R.a + j in
+    let arr = fov reg src radius in
+    let rec search lo hi =
+      if lo >= hi then false else
+      ( let mid = (lo + hi) / 2 in
+        let x = arr.(mid) in
+        if x = k then true
+        else if x < k then search (mid+1) hi
+        else search lo mid )
+    in
+    search 0 (Array.length arr) )
+
+(* visible cells from loc within the radius that satisfy p *)
+let visible_cells_with p reg loc radius =
+  Array.fold_left (fun acc k ->
+    let l = loc_of_cell reg k in
+    if p l then l :: acc else acc
+  ) [] (fov reg loc radius)
+
+(* units in the cells visible from loc within the radius, except loc itself *)
+let visible_units reg e loc radius =
+  Array.fold_left (fun acc k ->
+    let l = loc_of_cell reg k in
+    if l <> loc then List.rev_append (E.at l e) acc else acc
+  ) [] (fov reg loc radius)
+
+
+(* Version of the player's vision, increased whenever it is recomputed *)
+let version = ref 0
+
+(* what the last vision was computed from: the vision area, the tiles,
+   their version and the locations of the controlled units *)
+let last_key = ref None
 
 (* sight for the controller *)
 let update_sight controller reg z =
   let condition m = Unit.get_controller m = controller in 
-  zero_area z;
-  E.iter 
-    ( fun mob -> 
-        if condition mob then
-        ( let loc0 = mob.Unit.loc in
-          if Area.is_within reg.R.a loc0 then
-          ( Area.set z loc0 1;
-            Area.set reg.R.explored loc0 (Some (Area.get reg.R.a loc0));
-          );
-          List.iter
-            ( fun locmap -> add_sight reg.R.a (Some reg.R.explored) z
-                  (fun loc -> loc0 ++ (locmap (loc -- loc0)) )
-                  mob.Unit.loc 8 )
-            [ (fun (x,y) -> ( x, y));
-              (fun (x,y) -> (-x, y));
-              (fun (x,y) -> ( x,-y));
-              (fun (x,y) -> (-x,-y));
-              (fun (x,y) -> ( y, x));
-              (fun (x,y) -> (-y, x));
-              (fun (x,y) -> ( y,-x));
-              (fun (x,y) -> (-y,-x));
-            ]
-        )
-    ) reg.R.e
+  let locs = ref [] in
+  E.iter (fun mob -> if condition mob then locs := mob.Unit.loc :: !locs) reg.R.e;
+  let locs = !locs in
+  let unchanged =
+    match !last_key with
+    | Some (z', a', ver', locs') -> z' == z && a' == reg.R.a && ver' = reg.R.a.Tiles.version && locs' = locs
+    | None -> false
+  in
+  if not unchanged then
+  ( last_key := Some (z, reg.R.a, reg.R.a.Tiles.version, locs);
+    incr version;
+    zero_area z;
+    let h = Tiles.h reg.R.a in
+    List.iter (fun loc0 ->
+      Array.iter (fun k ->
+        let loc = (k / h, k mod h) in
+        Area.set z loc 1;
+        Area.set reg.R.explored loc (Some (Tiles.get reg.R.a loc))
+      ) (fov reg loc0 8)
+    ) locs )
   